@@ -4,9 +4,66 @@
 #include <string.h>
 #include <stddef.h>
 #include <math.h>
-
-typedef enum { PLUS, MINUS, SLASH, STAR, POW, LEFT_PAREN, RIGHT_PAREN, NUMBER, VAR, SIN, COS, TAN, LN, EXP } TokenType;
-typedef enum {LITERAL, EXPR} ValType;
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <time.h>
+
+// Differentiation rules for unary functions, one row per function:
+//   token, name, C implementation, operator joining u' and f'(u), f'(u),
+//   range of f over an interval u
+// so that d/dx f(u) = (op u' f'(u)). f'(u) is written with the node
+// builders defined above the generated rules, U standing for u; the range
+// with the interval helpers above evaluateInterval().
+#define UNARY_RULES(X) \
+  X(SIN,  "sin",  sin,  STAR,  FN(COS, U), \
+                               intervalSin(u)) \
+  X(COS,  "cos",  cos,  STAR,  MUL(NUM(-1), FN(SIN, U)), \
+                               intervalCos(u)) \
+  X(TAN,  "tan",  tan,  SLASH, EXPT(FN(COS, U), NUM(2)), \
+                               intervalTan(u)) \
+  X(LN,   "ln",   log,  SLASH, U, \
+                               intervalIncreasing(log, u, 0, INFINITY)) \
+  X(EXP,  "exp",  exp,  STAR,  FN(EXP, U), \
+                               intervalIncreasing(exp, u, -INFINITY, INFINITY)) \
+  X(SQRT, "sqrt", sqrt, SLASH, MUL(NUM(2), FN(SQRT, U)), \
+                               intervalIncreasing(sqrt, u, 0, INFINITY)) \
+  X(ASIN, "asin", asin, SLASH, FN(SQRT, SUB(NUM(1), EXPT(U, NUM(2)))), \
+                               intervalIncreasing(asin, u, -1, 1)) \
+  X(ACOS, "acos", acos, SLASH, MUL(NUM(-1), FN(SQRT, SUB(NUM(1), EXPT(U, NUM(2))))), \
+                               intervalDecreasing(acos, u, -1, 1)) \
+  X(ATAN, "atan", atan, SLASH, ADD(NUM(1), EXPT(U, NUM(2))), \
+                               intervalIncreasing(atan, u, -INFINITY, INFINITY)) \
+  X(SINH, "sinh", sinh, STAR,  FN(COSH, U), \
+                               intervalIncreasing(sinh, u, -INFINITY, INFINITY)) \
+  X(COSH, "cosh", cosh, STAR,  FN(SINH, U), \
+                               intervalCosh(u)) \
+  X(TANH, "tanh", tanh, SLASH, EXPT(FN(COSH, U), NUM(2)), \
+                               intervalIncreasing(tanh, u, -INFINITY, INFINITY))
+
+#define UNARY_TOKEN(token, ...) token,
+
+typedef enum { PLUS, MINUS, SLASH, STAR, POW, LEFT_PAREN, RIGHT_PAREN, NUMBER, VAR, UNARY_RULES(UNARY_TOKEN) } TokenType;
+typedef enum {LITERAL, EXPR, POLY, LAZY} ValType;
+
+#define MAX_POLY_DEGREE 4096
+// (^ p n) is only expanded up to this n. Beyond it the dense coefficients
+// cancel catastrophically near the roots of p, so the power stays factored.
+#define MAX_POW_EXPANSION 4
+// Interval bounds are widened outward by this many ulps after each step:
+// one covers a correctly rounded arithmetic result, libm functions get two.
+#define ARITH_ULPS 1
+#define LIBM_ULPS 2
+
+#define MAX_THREADS 64
+#define DEQUE_SIZE 1024
+#define NODE_CHUNK 1024
+// A thread keeps at most this many free nodes to itself.
+#define NODE_SPILL (4 * NODE_CHUNK)
+// Subtrees smaller than this are differentiated and simplified serially.
+#define PARALLEL_CUTOFF 4096
+// A fused program evaluates this many x values per pass.
+#define FUSED_LANES 64
 
 typedef struct {
   TokenType type;
@@ -18,53 +75,179 @@ typedef struct {
   size_t size;
 } TokensList;
 
+// Nodes are immutable once built and shared by reference counting, so an
+// input, its derivative and its simplification may all point at the same
+// subtrees. Every constructor returns a reference the caller owns.
+
+// Common prefix of Expr, Literal, Poly and Lazy.
+typedef struct {
+  ValType valType;
+  TokenType type;
+  int refCount;
+} Node;
+
 typedef struct {
   ValType valType;
   TokenType operator;
+  int refCount;
+  size_t size;
   void* op1;
   void* op2;
-  void* interpretThyself;
+  void* derivative;  // memoized dispatch() result
+  void* simplified;  // memoized simplify() result, may be the node itself
 } Expr;
 
 typedef struct {
   ValType valType;
   TokenType type;
+  int refCount;
   union {
     double number;
   } value;
-  void* interpretThyself;
 } Literal;
 
+// Dense polynomial in x: coeffs[i] multiplies x^i, degree + 1 entries.
+typedef struct {
+  ValType valType;
+  TokenType type;
+  int refCount;
+  int degree;
+  double* coeffs;
+} Poly;
+
+// Stands for d/dx of source until a consumer reaches it. Expanding it builds
+// one level of the derivative with Lazy nodes for the operands' derivatives.
+typedef struct {
+  ValType valType;
+  TokenType type;
+  int refCount;
+  Expr* source;
+  void* expansion;  // memoized forceLazy() result
+} Lazy;
+
+Expr* newExpr(TokenType operator, void* op1, void* op2);
+Literal* newNumber(double number);
+Literal* newVar();
+void* retain(void* node);
+void release(void* node);
+void* allocNode();
+void freeNode(void* node);
+size_t nodeSize(void* node);
+bool equalTrees(void* a, void* b);
+void* copyTree(void* node);
+void* memoize(void** slot, void* res, void* self);
+void forgetMemos(void* node);
+
 void* simplify(void* expr);
+void* simplifyForm(Expr* form, void* op1, void* op2);
 double operate(double a, double b, TokenType op);
+double evaluate(void* expr, double x);
+
+Poly* newPoly(int degree);
+Poly* asPoly(void* exprOrLiteral);
+Poly* combinePoly(TokenType op, Poly* a, Poly* b);
+void* polyToNode(Poly* poly);
+double evalPoly(const Poly* poly, double x);
+void evalPolyBatch(const Poly* poly, const double* xs, double* out, size_t n);
 
 
 char* lisptify(void* expr);
+char* formatNumber(double num);
+char* formatCoefficient(double num);
 
 void* dispatch(void* exprOrLiteral);
+void* applyRule(Expr* expr, void* du, void* dv);
+bool isArithmetic(TokenType op);
+
+void* lazyDerivative(void* exprOrLiteral);
+void* forceLazy(void* node);
+size_t printLazy(void* node, FILE* out, size_t limit);
+bool isZero(void* node);
+
+typedef void* (*TaskFn)(void*);
+void forkJoin(TaskFn fn, void* a, void* b, void** ra, void** rb);
+void startParallel(int threads);
+void stopParallel();
+bool releaseNodeMemory();
+void* parallelDispatch(void* exprOrLiteral);
+void* parallelSimplify(void* exprOrLiteral);
+
+// Keeps an expression together with its derivative and the simplified
+// derivative, and updates all three after a local edit.
+typedef struct {
+  void* expr;
+  void* derivative;
+  void* simplified;
+} DiffSession;
+
+// A set of expressions compiled into one straight-line instruction stream.
+// Identical subexpressions, within one expression or across several, are
+// computed once. A register is reused once the last instruction reading
+// it has run, so the register file stays small however long the program.
+typedef struct {
+  ValType kind;    // LITERAL, EXPR or POLY, as for the node it came from
+  TokenType op;
+  int a;           // operand registers, -1 when unused
+  int b;
+  int dst;         // register written
+  double number;
+  Poly* poly;
+} Instr;
+
+typedef struct {
+  Instr* code;
+  int size;
+  int capacity;
+  int registerCount;
+  int* outputs;      // registers holding the results
+  int outputCount;
+  int* instrTable;   // hash of instruction -> register, for sharing
+  void** nodeKeys;   // node pointer -> register, so shared subtrees are walked once
+  int* nodeSlots;
+  int nodeCount;
+  int tableSize;
+} Program;
+
+// Closed interval [lo, hi]; NaN bounds mark the empty interval.
+typedef struct {
+  double lo;
+  double hi;
+} Interval;
+
+Interval evaluateInterval(void* expr, Interval x);
+size_t findRootRegions(void* expr, void* derivative, Interval domain, double tolerance,
+                       Interval* out, size_t capacity);
+
+Program* compileProgram(void** exprs, int count);
+void runProgram(const Program* program, const double* xs, size_t n, double* out);
+void runIntervalProgram(const Program* program, const Interval* xs, size_t n, Interval* out);
+void freeProgram(Program* program);
+
+void* replaceSubtree(void* root, const char* path, void* replacement);
+DiffSession* newSession(void* expr);
+bool editSession(DiffSession* session, const char* path, void* replacement);
+void freeSession(DiffSession* session);
 void printAST(void* exprOrLiteral);
 void printTokens(TokensList tokens);
 void* parse(TokensList t, int* idx, int sz);
 void* expr(TokensList t, int* idx, int sz);
 void* operand(TokensList t, int* idx,int sz);
 bool isDigit(char c);
+int matchFunction(const char* source, TokenType* type);
 
 const char* diff (const char* expr);
 
 void* derivNum();
 void* derivVar();
-void* derivAdd(Expr* expr);
-void* derivSub(Expr* expr);
-void* derivMult(Expr* expr);
-void* derivQuot(Expr* expr);
-void* derivPow(Expr* expr);
-
-void* derivCos(Expr* expr);
-void* derivSin(Expr* expr);
-void* derivTan(Expr* expr);
+void* derivAdd(Expr* expr, void* du, void* dv);
+void* derivSub(Expr* expr, void* du, void* dv);
+void* derivMult(Expr* expr, void* du, void* dv);
+void* derivQuot(Expr* expr, void* du, void* dv);
+void* derivPow(Expr* expr, void* du, void* dv);
+void* derivPoly(Poly* poly);
 
-void* derivLn(Expr* expr);
-void* derivExp(Expr* expr);
+#define DECLARE_UNARY_RULE(token, ...) void* deriv##token(Expr* expr, void* du);
+UNARY_RULES(DECLARE_UNARY_RULE)
 
 
 char* lisptify(void* exprOrLiteral) {
@@ -73,6 +256,8 @@ char* lisptify(void* exprOrLiteral) {
   ValType type = *((ValType*) exprOrLiteral);
   char* res = NULL;
 
+  if (type == LAZY) return lisptify(forceLazy(exprOrLiteral));
+
   if (type == EXPR) {
     Expr* expr = (Expr*) exprOrLiteral;
     TokenType operator = *(((TokenType*) exprOrLiteral) + 1);
@@ -95,21 +280,11 @@ char* lisptify(void* exprOrLiteral) {
       case POW:
         asprintf(&res, "%s^ ", res);
         break;
-      case SIN:
-        asprintf(&res, "%ssin ", res);
-        break;
-      case COS:
-        asprintf(&res, "%scos ", res);
-        break;
-      case TAN:
-        asprintf(&res, "%stan ", res);
-        break;
-      case EXP:
-        asprintf(&res, "%sexp ", res);
-        break;
-      case LN:
-        asprintf(&res, "%sln ", res);
+#define LISPTIFY_CASE(token, name, ...) \
+      case token: \
+        asprintf(&res, "%s" name " ", res); \
         break;
+      UNARY_RULES(LISPTIFY_CASE)
       default:
         asprintf(&res, "%s? ", res);
         break;
@@ -128,12 +303,7 @@ char* lisptify(void* exprOrLiteral) {
     TokenType varOrNum = *(((TokenType*) exprOrLiteral) + 1);
 
     if (varOrNum == NUMBER) {
-      double num = literal->value.number;
-      if(num == (int) num) {
-        asprintf(&res, "%.0f", literal->value.number);
-      } else {
-        asprintf(&res, "%.1f", literal->value.number);
-      }
+      res = formatNumber(literal->value.number);
     } else if (varOrNum == VAR) {
       asprintf(&res, "x");
     }
@@ -141,9 +311,71 @@ char* lisptify(void* exprOrLiteral) {
     return res;
   }
 
+  if (type == POLY) {
+    Poly* poly = (Poly*) exprOrLiteral;
+
+    // Expanded form, highest power outermost: (+ (* 3 (^ x 2)) (+ (* 2 x) 1))
+    for (int i = 0; i <= poly->degree; i++) {
+      double c = poly->coeffs[i];
+      if (c == 0 && (i > 0 || poly->degree > 0)) continue;
+
+      char* term = NULL;
+      char* num = formatCoefficient(c);
+      if (i == 0) {
+        term = num;
+      } else {
+        char* power = NULL;
+        if (i == 1) asprintf(&power, "x");
+        else asprintf(&power, "(^ x %d)", i);
+
+        if (c == 1) {
+          term = power;
+        } else {
+          asprintf(&term, "(* %s %s)", num, power);
+          free(power);
+        }
+        free(num);
+      }
+
+      if (res == NULL) {
+        res = term;
+      } else {
+        char* sum = NULL;
+        asprintf(&sum, "(+ %s %s)", term, res);
+        free(term);
+        free(res);
+        res = sum;
+      }
+    }
+
+    return res ? res : strdup("0");
+  }
+
   return strdup("");
 }
 
+char* formatNumber(double num) {
+  char* res = NULL;
+  if(num == (int) num) {
+    asprintf(&res, "%.0f", num);
+  } else {
+    asprintf(&res, "%.1f", num);
+  }
+  return res;
+}
+
+// Coefficients are computed rather than parsed, so print the shortest form
+// that reads back as the same double instead of formatNumber()'s one digit.
+char* formatCoefficient(double num) {
+  char* res = NULL;
+  for (int digits = 15; digits <= 17; digits++) {
+    free(res);
+    asprintf(&res, "%.*g", digits, num);
+    if (strtod(res, NULL) == num) break;
+  }
+  return res;
+}
+
 double operate(double a, double b, TokenType op) {
     switch(op) {
         case PLUS:
@@ -156,491 +388,1883 @@ double operate(double a, double b, TokenType op) {
             return a / b;
         case POW:
             return pow(a, b);
+        default:
+            return NAN;
+    }
+}
+
+double evaluate(void* exprOrLiteral, double x) {
+    if (exprOrLiteral == NULL) return NAN;
+
+    ValType type = *((ValType*) exprOrLiteral);
+
+    if (type == LITERAL) {
+        Literal* literal = (Literal*) exprOrLiteral;
+        return literal->type == VAR ? x : literal->value.number;
+    }
+
+    if (type == POLY) {
+        return evalPoly((Poly*) exprOrLiteral, x);
+    }
+
+    if (type == LAZY) {
+        return evaluate(forceLazy(exprOrLiteral), x);
+    }
+
+    Expr* expr = (Expr*) exprOrLiteral;
+    double a = evaluate(expr->op1, x);
+
+    switch (expr->operator) {
+#define EVALUATE_CASE(token, name, fn, ...) case token: return fn(a);
+        UNARY_RULES(EVALUATE_CASE)
+        default: return operate(a, evaluate(expr->op2, x), expr->operator);
     }
 }
 
+// Returns a new reference; the input is never modified. Subtrees that do
+// not change are shared with the input rather than copied.
 void* simplify(void* exprOrLiteral) {
     if (exprOrLiteral == NULL) return NULL;
 
     ValType type = *((ValType*) exprOrLiteral);
 
-    if (type == EXPR) {
-        Expr* form = (Expr*) exprOrLiteral;
+    if (type == EXPR) {
+        Expr* form = (Expr*) exprOrLiteral;
+
+        void* cached = __atomic_load_n(&form->simplified, __ATOMIC_ACQUIRE);
+        if (cached) return retain(cached);
+
+        void* op1;
+        void* op2;
+        if (isArithmetic(form->operator) && form->size >= PARALLEL_CUTOFF) {
+            forkJoin(simplify, form->op1, form->op2, &op1, &op2);
+        } else {
+            op1 = simplify(form->op1);
+            op2 = simplify(form->op2);
+        }
+
+        void* res = simplifyForm(form, op1, op2);
+        release(op1);
+        release(op2);
+        return memoize(&form->simplified, res, form);
+    }
+
+    if (type == LAZY) return simplify(forceLazy(exprOrLiteral));
+
+    return retain(exprOrLiteral);
+}
+
+// Simplify a single node given its already simplified operands (borrowed).
+void* simplifyForm(Expr* form, void* op1, void* op2) {
+    op1 = forceLazy(op1);
+    op2 = forceLazy(op2);
+    if (op1 == NULL) return NULL;
+
+    // Polynomial subtrees collapse into a dense coefficient array.
+    Poly* p1 = asPoly(op1);
+    Poly* p2 = asPoly(op2);
+    Poly* combined = p1 && p2 ? combinePoly(form->operator, p1, p2) : NULL;
+    release(p1);
+    release(p2);
+    if (combined) return polyToNode(combined);
+
+    ValType o1t = *((ValType*) op1);
+    ValType o2t = op2 ? *((ValType*) op2) : -10000;
+
+    if (o1t == LITERAL && o2t == LITERAL) {
+        Literal* a = (Literal*)op1;
+        Literal* b = (Literal*)op2;
+        TokenType at = a->type;
+        TokenType bt = b->type;
+
+        // Handle addition
+        if (form->operator == PLUS) {
+            if (at == NUMBER && bt == NUMBER) {
+                return newNumber(a->value.number + b->value.number);
+            }
+            if (at == NUMBER && a->value.number == 0) return retain(b); // 0 + b = b
+            if (bt == NUMBER && b->value.number == 0) return retain(a); // a + 0 = a
+        }
+
+
+        // Handle subtraction
+        if (form->operator == MINUS) {
+            if (at == NUMBER && bt == NUMBER) {
+                return newNumber(a->value.number - b->value.number);
+            }
+            if (bt == NUMBER && b->value.number == 0) return retain(a); // a - 0 = a
+
+          //return exprOrLiteral;
+        }
+
+        // Handle multiplication
+        if (form->operator == STAR) {
+            if (at == NUMBER && bt == NUMBER) {
+                return newNumber(a->value.number * b->value.number);
+            }
+            if ((at == NUMBER && a->value.number == 0) || (bt == NUMBER && b->value.number == 0)) {
+                return newNumber(0); // 0 * anything = 0
+            }
+            if (at == NUMBER && a->value.number == 1) return retain(b); // 1 * b = b
+            if (bt == NUMBER && b->value.number == 1) return retain(a); // a * 1 = a
+
+            //return exprOrLiteral;
+        }
+
+        // Handle division
+        if (form->operator == SLASH) {
+            if (bt == NUMBER && b->value.number == 0) {
+                // Division by zero handling
+                return NULL; // or some error handling
+            }
+            if (at == NUMBER && bt == NUMBER) {
+                return newNumber(a->value.number / b->value.number);
+            }
+            if (bt == NUMBER && b->value.number == 1) return retain(a); // a / 1 = a
+            if (at == NUMBER && a->value.number == 0) {
+                return newNumber(0); // 0 / anything = 0
+            }
+          //return exprOrLiteral;
+        }
+
+        // Handle exponentiation
+        if (form->operator == POW) {
+            if(bt == NUMBER && b->value.number == 1) {
+              return retain(a);
+            }
+            if (at == NUMBER && bt == NUMBER) {
+                return newNumber(pow(a->value.number, b->value.number));
+            }
+            if (bt == NUMBER && b->value.number == 0) {
+                // Any number to the power of 0 is 1
+                return newNumber(1);
+            }
+            if (at == NUMBER && a->value.number == 0 && b->value.number > 0) {
+                // 0 to any positive power is 0
+                return newNumber(0);
+            }
+            if (at == NUMBER && a->value.number == 1) {
+                return retain(a); // 1 to any power is 1
+            }
+
+              //return exprOrLiteral;
+
+        }
+    }
+
+
+    if(o1t == LITERAL && o2t != LITERAL) {
+
+        Literal* a = (Literal*)op1;
+        Expr* b = (Expr*)op2;
+      if(form->operator == PLUS) {
+        if(a->type == NUMBER && a->value.number == 0) {
+          return retain(b);
+        }
+      }
+
+      if(form->operator == STAR) {
+        if(a->type == NUMBER && a->value.number == 0) {
+          return newNumber(0);
+        }
+
+        if(a->type == NUMBER && a->value.number == 1) {
+          return retain(b);
+        }
+      }
+
+    }
+
+
+    if(o2t == LITERAL && o1t != LITERAL) {
+
+                  Expr* a = (Expr*)op1;
+        Literal* b = (Literal*)op2;
+      if(form->operator == PLUS) {
+        if(b->type == NUMBER && b->value.number == 0) {
+          return retain(a);
+        }
+      }
+
+      if(form->operator == STAR) {
+        if(b->type == NUMBER && b->value.number == 0) {
+          return newNumber(0);
+        }
+
+        if(b->type == NUMBER && b->value.number == 1) {
+          return retain(a);
+        }
+      }
+
+      if(form->operator == POW) {
+        if(b->type == NUMBER && b->value.number == 1) {
+          return retain(a); // a^1 = a
+        }
+        if(b->type == NUMBER && b->value.number == 0) {
+          return newNumber(1); // a^0 = 1
+        }
+      }
+
+    }
+
+
+    // Copy on write: reuse the node when neither operand changed.
+    if (op1 == form->op1 && op2 == form->op2) return retain(form);
+
+    return newExpr(form->operator, retain(op1), retain(op2));
+}
+
+
+Expr* newExpr(TokenType operator, void* op1, void* op2) {
+    Expr* expr = allocNode();
+    expr->valType = EXPR;
+    expr->operator = operator;
+    expr->refCount = 1;
+    expr->size = 1 + nodeSize(op1) + nodeSize(op2);
+    expr->op1 = op1;
+    expr->op2 = op2;
+    expr->derivative = NULL;
+    expr->simplified = NULL;
+    return expr;
+}
+
+Literal* newNumber(double number) {
+    Literal* literal = allocNode();
+    literal->valType = LITERAL;
+    literal->type = NUMBER;
+    literal->refCount = 1;
+    literal->value.number = number;
+    return literal;
+}
+
+Literal* newVar() {
+    Literal* literal = newNumber(0);
+    literal->type = VAR;
+    return literal;
+}
+
+// Reference counts are atomic so subtrees can be shared between threads.
+void* retain(void* node) {
+    if (node != NULL) __atomic_fetch_add(&((Node*) node)->refCount, 1, __ATOMIC_RELAXED);
+    return node;
+}
+
+void release(void* node) {
+    if (node == NULL) return;
+    if (__atomic_sub_fetch(&((Node*) node)->refCount, 1, __ATOMIC_ACQ_REL) > 0) return;
+
+    ValType type = *((ValType*) node);
+    if (type == EXPR) {
+        Expr* expr = (Expr*) node;
+        release(expr->op1);
+        release(expr->op2);
+        release(expr->derivative);
+        if (expr->simplified != expr) release(expr->simplified);
+    }
+    if (type == LAZY) {
+        release(((Lazy*) node)->source);
+        release(((Lazy*) node)->expansion);
+    }
+    if (type == POLY) {
+        free(((Poly*) node)->coeffs);
+    }
+    freeNode(node);
+}
+
+// Nodes come from per-thread free lists so parallel workers never contend
+// on malloc. A node released on another thread joins that thread's list.
+// Lists that grow past NODE_SPILL blocks, and the lists of exiting
+// workers, move to nodePool, which allocNode() drains before carving a new
+// chunk; releaseNodeMemory() gives the chunks back once every node is gone.
+typedef union NodeBlock {
+    union NodeBlock* next;
+    Expr expr;
+    Literal literal;
+    Poly poly;
+    Lazy lazy;
+} NodeBlock;
+
+typedef struct NodeChunk {
+    struct NodeChunk* next;
+    NodeBlock blocks[NODE_CHUNK];
+} NodeChunk;
+
+typedef struct {
+    NodeBlock* head;
+    NodeBlock* tail;
+    size_t count;
+} FreeList;
+
+static struct {
+    pthread_mutex_t lock;
+    FreeList free;      // blocks handed over by other threads
+    NodeChunk* chunks;  // every chunk allocated so far
+    long liveNodes;     // allocations minus frees of exited threads
+} nodePool = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static __thread FreeList freeNodes;
+// Allocations minus frees on this thread; negative when it frees nodes
+// that another thread allocated.
+static __thread long liveNodes = 0;
+
+static void spillFreeNodes() {
+    if (freeNodes.head == NULL) return;
+
+    pthread_mutex_lock(&nodePool.lock);
+    freeNodes.tail->next = nodePool.free.head;
+    if (nodePool.free.head == NULL) nodePool.free.tail = freeNodes.tail;
+    nodePool.free.head = freeNodes.head;
+    nodePool.free.count += freeNodes.count;
+    pthread_mutex_unlock(&nodePool.lock);
+
+    freeNodes = (FreeList) { NULL, NULL, 0 };
+}
+
+void* allocNode() {
+    if (freeNodes.head == NULL) {
+        pthread_mutex_lock(&nodePool.lock);
+        if (nodePool.free.head) {
+            // Take one chunk's worth, so no thread hoards the shared list.
+            NodeBlock* tail = nodePool.free.head;
+            size_t count = 1;
+            for (; count < NODE_CHUNK && tail->next; count++) tail = tail->next;
+
+            freeNodes = (FreeList) { nodePool.free.head, tail, count };
+            nodePool.free.head = tail->next;
+            nodePool.free.count -= count;
+            if (nodePool.free.head == NULL) nodePool.free.tail = NULL;
+            tail->next = NULL;
+        } else {
+            NodeChunk* chunk = malloc(sizeof(NodeChunk));
+            chunk->next = nodePool.chunks;
+            nodePool.chunks = chunk;
+            for (int i = 0; i < NODE_CHUNK - 1; i++) chunk->blocks[i].next = &chunk->blocks[i + 1];
+            chunk->blocks[NODE_CHUNK - 1].next = NULL;
+            freeNodes = (FreeList) { chunk->blocks, &chunk->blocks[NODE_CHUNK - 1], NODE_CHUNK };
+        }
+        pthread_mutex_unlock(&nodePool.lock);
+    }
+
+    NodeBlock* block = freeNodes.head;
+    freeNodes.head = block->next;
+    if (--freeNodes.count == 0) freeNodes.tail = NULL;
+    liveNodes++;
+    return block;
+}
+
+void freeNode(void* node) {
+    NodeBlock* block = (NodeBlock*) node;
+    block->next = freeNodes.head;
+    if (freeNodes.head == NULL) freeNodes.tail = block;
+    freeNodes.head = block;
+    liveNodes--;
+
+    if (++freeNodes.count > NODE_SPILL) spillFreeNodes();
+}
+
+// Called by a thread that is about to exit.
+static void returnFreeNodes() {
+    spillFreeNodes();
+
+    pthread_mutex_lock(&nodePool.lock);
+    nodePool.liveNodes += liveNodes;
+    pthread_mutex_unlock(&nodePool.lock);
+    liveNodes = 0;
+}
+
+// Number of nodes in the tree below (and including) node; shared subtrees
+// count once per reference.
+size_t nodeSize(void* node) {
+    if (node == NULL) return 0;
+    if (*((ValType*) node) == EXPR) return ((Expr*) node)->size;
+    return 1;
+}
+
+// Publishes res in *slot unless another thread got there first, and returns
+// a new reference to whichever value ended up cached. The slot owns its own
+// reference, except to self, which would otherwise never be freed.
+void* memoize(void** slot, void* res, void* self) {
+    if (res == NULL) return NULL;
+
+    void* expected = NULL;
+    if (__atomic_compare_exchange_n(slot, &expected, res, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        if (res != self) retain(res);
+        return res;
+    }
+
+    release(res);
+    return retain(expected);
+}
+
+// Nodes already visited by a walk over a tree that may share subtrees.
+typedef struct {
+    void** keys;
+    size_t capacity;
+    size_t count;
+} NodeSet;
+
+// Adds node to set; false if it was there already.
+static bool addToSet(NodeSet* set, void* node) {
+    if (2 * (set->count + 1) > set->capacity) {
+        NodeSet grown = { calloc(set->capacity ? 2 * set->capacity : 64, sizeof(void*)),
+                          set->capacity ? 2 * set->capacity : 64, 0 };
+        for (size_t i = 0; i < set->capacity; i++) {
+            if (set->keys[i]) addToSet(&grown, set->keys[i]);
+        }
+        free(set->keys);
+        *set = grown;
+    }
+
+    size_t mask = set->capacity - 1;
+    size_t h = ((uintptr_t) node >> 4) * 0x9E3779B97F4A7C15ull & mask;
+    for (; set->keys[h] != NULL; h = (h + 1) & mask) {
+        if (set->keys[h] == node) return false;
+    }
+    set->keys[h] = node;
+    set->count++;
+    return true;
+}
+
+static void forgetNode(void* node, NodeSet* visited) {
+    if (node == NULL || *((ValType*) node) != EXPR || !addToSet(visited, node)) return;
+
+    Expr* expr = (Expr*) node;
+    void* derivative = expr->derivative;
+    void* simplified = expr->simplified;
+    expr->derivative = NULL;
+    expr->simplified = NULL;
+    release(derivative);
+    if (simplified != expr) release(simplified);
+
+    forgetNode(expr->op1, visited);
+    forgetNode(expr->op2, visited);
+}
+
+// Drops the derivatives and simplifications memoized on node and every
+// node below it, so that a long-lived input stops keeping them alive. Must
+// not run while another thread differentiates or simplifies these nodes.
+void forgetMemos(void* node) {
+    NodeSet visited = { NULL, 0, 0 };
+    forgetNode(node, &visited);
+    free(visited.keys);
+}
+
+bool equalTrees(void* a, void* b) {
+    if (a == b) return true;
+    if (a == NULL || b == NULL) return false;
+    if (*((ValType*) a) == LAZY || *((ValType*) b) == LAZY) return equalTrees(forceLazy(a), forceLazy(b));
+
+    ValType type = *((ValType*) a);
+    if (type != *((ValType*) b)) return false;
+
+    if (type == LITERAL) {
+        Literal* la = (Literal*) a;
+        Literal* lb = (Literal*) b;
+        return la->type == lb->type && (la->type == VAR || la->value.number == lb->value.number);
+    }
+
+    if (type == POLY) {
+        Poly* pa = (Poly*) a;
+        Poly* pb = (Poly*) b;
+        return pa->degree == pb->degree &&
+               memcmp(pa->coeffs, pb->coeffs, (pa->degree + 1) * sizeof(double)) == 0;
+    }
+
+    Expr* ea = (Expr*) a;
+    Expr* eb = (Expr*) b;
+    return ea->operator == eb->operator && equalTrees(ea->op1, eb->op1) && equalTrees(ea->op2, eb->op2);
+}
+
+// Deep copy without any memoized results.
+void* copyTree(void* node) {
+    if (node == NULL) return NULL;
+
+    ValType type = *((ValType*) node);
+    if (type == LITERAL) {
+        Literal* literal = (Literal*) node;
+        return literal->type == VAR ? newVar() : newNumber(literal->value.number);
+    }
+    if (type == POLY) return polyToNode(asPoly(node));
+    if (type == LAZY) return copyTree(forceLazy(node));
+
+    Expr* expr = (Expr*) node;
+    return newExpr(expr->operator, copyTree(expr->op1), copyTree(expr->op2));
+}
+
+Poly* newPoly(int degree) {
+    Poly* poly = allocNode();
+    poly->valType = POLY;
+    poly->type = VAR;
+    poly->refCount = 1;
+    poly->degree = degree;
+    poly->coeffs = calloc(degree + 1, sizeof(double));
+    return poly;
+}
+
+// Copy a literal or polynomial node into a fresh Poly, NULL for anything else.
+Poly* asPoly(void* exprOrLiteral) {
+    if (exprOrLiteral == NULL) return NULL;
+
+    ValType type = *((ValType*) exprOrLiteral);
+    if (type == LAZY) return asPoly(forceLazy(exprOrLiteral));
+
+    if (type == LITERAL) {
+        Literal* literal = (Literal*) exprOrLiteral;
+        if (literal->type == VAR) {
+            Poly* poly = newPoly(1);
+            poly->coeffs[1] = 1;
+            return poly;
+        }
+        Poly* poly = newPoly(0);
+        poly->coeffs[0] = literal->value.number;
+        return poly;
+    }
+
+    if (type == POLY) {
+        Poly* src = (Poly*) exprOrLiteral;
+        Poly* poly = newPoly(src->degree);
+        memcpy(poly->coeffs, src->coeffs, (src->degree + 1) * sizeof(double));
+        return poly;
+    }
+
+    return NULL;
+}
+
+static bool isFinitePoly(const Poly* poly) {
+    for (int i = 0; i <= poly->degree; i++) {
+        if (!isfinite(poly->coeffs[i])) return false;
+    }
+    return true;
+}
+
+// Combine two polynomials under op, NULL if the result is not a polynomial
+// or expanding it would change its value.
+Poly* combinePoly(TokenType op, Poly* a, Poly* b) {
+    Poly* res = NULL;
+
+    switch (op) {
+        case PLUS:
+        case MINUS: {
+            int degree = a->degree > b->degree ? a->degree : b->degree;
+            res = newPoly(degree);
+            for (int i = 0; i <= a->degree; i++) res->coeffs[i] = a->coeffs[i];
+            for (int i = 0; i <= b->degree; i++) {
+                res->coeffs[i] += op == PLUS ? b->coeffs[i] : -b->coeffs[i];
+            }
+            break;
+        }
+
+        case STAR: {
+            if (a->degree + b->degree > MAX_POLY_DEGREE) return NULL;
+            res = newPoly(a->degree + b->degree);
+            for (int i = 0; i <= a->degree; i++) {
+                for (int j = 0; j <= b->degree; j++) {
+                    res->coeffs[i + j] += a->coeffs[i] * b->coeffs[j];
+                }
+            }
+            break;
+        }
+
+        case SLASH: {
+            // Only division by a non-zero constant keeps us polynomial.
+            if (b->degree != 0 || b->coeffs[0] == 0) return NULL;
+            res = newPoly(a->degree);
+            for (int i = 0; i <= a->degree; i++) res->coeffs[i] = a->coeffs[i] / b->coeffs[0];
+            break;
+        }
+
+        case POW: {
+            if (b->degree != 0) return NULL;
+            double e = b->coeffs[0];
+
+            if (a->degree == 0) {
+                res = newPoly(0);
+                res->coeffs[0] = pow(a->coeffs[0], e);
+                break;
+            }
+
+            if (e < 0 || e != (int) e || e > MAX_POW_EXPANSION) return NULL;
+
+            res = newPoly(0);
+            res->coeffs[0] = 1;
+            for (int n = 0; n < (int) e && res; n++) {
+                Poly* next = combinePoly(STAR, res, a);
+                release(res);
+                res = next;
+            }
+            break;
+        }
+
+        default:
+            return NULL;
+    }
+
+    // A coefficient that overflowed would turn finite values into inf or NaN.
+    if (res && !isFinitePoly(res)) {
+        release(res);
+        return NULL;
+    }
+    return res;
+}
+
+// Takes ownership of poly. Drops trailing zero coefficients and hands back
+// the smallest node that represents it: a number, x itself, or the Poly.
+void* polyToNode(Poly* poly) {
+    while (poly->degree > 0 && poly->coeffs[poly->degree] == 0) poly->degree--;
+
+    if (poly->degree == 0) {
+        Literal* res = newNumber(poly->coeffs[0]);
+        release(poly);
+        return res;
+    }
+
+    if (poly->degree == 1 && poly->coeffs[0] == 0 && poly->coeffs[1] == 1) {
+        release(poly);
+        return newVar();
+    }
+
+    return poly;
+}
+
+double evalPoly(const Poly* poly, double x) {
+    double acc = poly->coeffs[poly->degree];
+    for (int i = poly->degree - 1; i >= 0; i--) acc = acc * x + poly->coeffs[i];
+    return acc;
+}
+
+// Horner's method across a batch of x values; the inner loop has no
+// dependency between lanes so the compiler can vectorize it.
+void evalPolyBatch(const Poly* poly, const double* xs, double* out, size_t n) {
+    const double* c = poly->coeffs;
+    for (size_t j = 0; j < n; j++) out[j] = c[poly->degree];
+    for (int i = poly->degree - 1; i >= 0; i--) {
+        for (size_t j = 0; j < n; j++) out[j] = out[j] * xs[j] + c[i];
+    }
+}
+
+void* dispatch(void* exprOrLiteral) {
+  if(exprOrLiteral == NULL) return NULL;
+  ValType type = *((ValType*) exprOrLiteral);
+
+  if(type == LAZY) return dispatch(forceLazy(exprOrLiteral));
+
+  if(type == EXPR) {
+    Expr* expr = (Expr*) exprOrLiteral;
+
+    // Nodes are immutable, so a derivative computed once stays valid.
+    void* cached = __atomic_load_n(&expr->derivative, __ATOMIC_ACQUIRE);
+    if(cached) return retain(cached);
+
+    // Every rule is handed its operands' derivatives, so the two sides of
+    // a large arithmetic node can be differentiated on separate threads.
+    void* du;
+    void* dv;
+    if(isArithmetic(expr->operator) && expr->size >= PARALLEL_CUTOFF) {
+      forkJoin(dispatch, expr->op1, expr->op2, &du, &dv);
+    } else {
+      du = dispatch(expr->op1);
+      dv = dispatch(expr->op2);
+    }
+
+    return memoize(&expr->derivative, applyRule(expr, du, dv), expr);
+  }
+
+  if(type == LITERAL) {
+    Literal* literal = (Literal*) exprOrLiteral;
+    return literal->type == VAR ? derivVar() : derivNum();
+  }
+
+  if(type == POLY) {
+    return derivPoly((Poly*) exprOrLiteral);
+  }
+
+  return NULL;
+}
+
+// Builds d/dx of expr from its operands' derivatives du and dv, taking
+// ownership of both.
+void* applyRule(Expr* expr, void* du, void* dv) {
+  switch(expr->operator) {
+    case PLUS: return derivAdd(expr, du, dv);
+    case MINUS: return derivSub(expr, du, dv);
+    case STAR: return derivMult(expr, du, dv);
+    case SLASH: return derivQuot(expr, du, dv);
+    case POW: return derivPow(expr, du, dv);
+#define DISPATCH_CASE(token, ...) case token: return deriv##token(expr, du);
+    UNARY_RULES(DISPATCH_CASE)
+    default:
+      release(du);
+      release(dv);
+      return NULL;
+  }
+}
+
+bool isArithmetic(TokenType op) {
+  return op == PLUS || op == MINUS || op == STAR || op == SLASH;
+}
+
+void* derivNum() {
+  return (void*) newNumber(0);
+}
+
+void* derivVar() {
+  return (void*) newNumber(1);
+}
+
+
+// Derivatives share the operands of the input by reference; the input
+// itself is never modified.
+
+void* derivAdd(Expr* expr, void* du, void* dv) {
+  return (void*) newExpr(PLUS, du, dv);
+}
+
+void* derivSub(Expr* expr, void* du, void* dv) {
+  return (void*) newExpr(MINUS, du, dv);
+}
+
+void* derivMult(Expr* expr, void* du, void* dv) {
+  // u'v
+  Expr* u = newExpr(STAR, du, retain(expr->op2));
+
+  // v'u
+  Expr* v = newExpr(STAR, retain(expr->op1), dv);
+
+  // u'v + v'u
+  return (void*) newExpr(PLUS, u, v);
+}
+
+void* derivQuot(Expr* expr, void* du, void* dv) {
+  // u'v
+  Expr* u = newExpr(STAR, du, retain(expr->op2));
+
+  // v'u
+  Expr* v = newExpr(STAR, retain(expr->op1), dv);
+
+  // u'v - v'u
+  Expr* uv = newExpr(MINUS, u, v);
+
+  // v^2
+  Expr* vv = newExpr(POW, retain(expr->op2), newNumber(2));
+
+  // Combine ( u'v - v'u ) / v^2
+  return (void*) newExpr(SLASH, uv, vv);
+}
+
+void* derivPow(Expr* expr, void* du, void* dv) {
+  void* u = expr->op1;
+  void* v = expr->op2;
+
+  // u' * n u^(n - 1) for a constant exponent
+  if(*((ValType*) v) == LITERAL && ((Literal*) v)->type == NUMBER) {
+    double power = ((Literal*) v)->value.number;
+    release(dv);
+
+    Expr* lowered = newExpr(POW, retain(u), newNumber(power - 1));
+    return (void*) newExpr(STAR, du, newExpr(STAR, newNumber(power), lowered));
+  }
+
+  // The same for an exponent such as (+ 1 1) that is constant but not yet
+  // folded; the general rule below would take ln u and divide by u.
+  if(isZero(dv)) {
+    release(dv);
+
+    Expr* lowered = newExpr(POW, retain(u), newExpr(MINUS, retain(v), newNumber(1)));
+    return (void*) newExpr(STAR, du, newExpr(STAR, retain(v), lowered));
+  }
+
+  // v' * a^v ln a for a constant base
+  if(*((ValType*) u) == LITERAL && ((Literal*) u)->type == NUMBER) {
+    release(du);
+
+    Expr* scale = newExpr(STAR, newExpr(POW, retain(u), retain(v)), newExpr(LN, retain(u), NULL));
+    return (void*) newExpr(STAR, dv, scale);
+  }
+
+  // u^v (v' ln u + v u' / u) in general
+  Expr* lnTerm = newExpr(STAR, dv, newExpr(LN, retain(u), NULL));
+  Expr* quotTerm = newExpr(SLASH, newExpr(STAR, retain(v), du), retain(u));
+  Expr* power = newExpr(POW, retain(u), retain(v));
+  return (void*) newExpr(STAR, power, newExpr(PLUS, lnTerm, quotTerm));
+}
+
+// Node builders for the f'(u) column of UNARY_RULES. Rules build fresh
+// nodes around u and never reuse expr itself, whose memoized derivative
+// would otherwise hold a reference back to it.
+#define U          retain(expr->op1)
+#define NUM(n)     newNumber(n)
+#define FN(f, a)   newExpr(f, a, NULL)
+#define ADD(a, b)  newExpr(PLUS, a, b)
+#define SUB(a, b)  newExpr(MINUS, a, b)
+#define MUL(a, b)  newExpr(STAR, a, b)
+#define EXPT(a, b) newExpr(POW, a, b)
+
+#define DEFINE_UNARY_RULE(token, name, fn, op, outer, ...) \
+  void* deriv##token(Expr* expr, void* du) { \
+    return (void*) newExpr(op, du, outer); \
+  }
+UNARY_RULES(DEFINE_UNARY_RULE)
+
+#undef U
+#undef NUM
+#undef FN
+#undef ADD
+#undef SUB
+#undef MUL
+#undef EXPT
+
+void* derivPoly(Poly* poly) {
+  // d/dx sum c_i x^i = sum i c_i x^(i-1)
+  Poly* res = newPoly(poly->degree > 0 ? poly->degree - 1 : 0);
+  for(int i = 1; i <= poly->degree; i++) {
+    res->coeffs[i - 1] = i * poly->coeffs[i];
+  }
+
+  return polyToNode(res);
+}
+
+
+// Returns d/dx of exprOrLiteral as a view that is only built as far as a
+// consumer reads it. Everything that reads trees, from lisptify() and
+// evaluate() to dispatch(), simplify() and lazyDerivative() itself, accepts
+// views and expands Lazy nodes as it reaches them; printLazy() and isZero()
+// stop reading early.
+void* lazyDerivative(void* exprOrLiteral) {
+  if(exprOrLiteral == NULL) return NULL;
+  if(*((ValType*) exprOrLiteral) == LAZY) return lazyDerivative(forceLazy(exprOrLiteral));
+  if(*((ValType*) exprOrLiteral) != EXPR) return dispatch(exprOrLiteral);
+
+  Expr* expr = (Expr*) exprOrLiteral;
+  void* cached = __atomic_load_n(&expr->derivative, __ATOMIC_ACQUIRE);
+  if(cached) return retain(cached);
+
+  Lazy* lazy = allocNode();
+  lazy->valType = LAZY;
+  lazy->type = expr->operator;
+  lazy->refCount = 1;
+  lazy->source = retain(expr);
+  lazy->expansion = NULL;
+  return lazy;
+}
+
+// Borrowed: the expansion of a Lazy node, or any other node unchanged. The
+// expansion is memoized in the Lazy node, so it lives as long as the view.
+void* forceLazy(void* node) {
+  if(node == NULL || *((ValType*) node) != LAZY) return node;
+
+  Lazy* lazy = (Lazy*) node;
+  void* cached = __atomic_load_n(&lazy->expansion, __ATOMIC_ACQUIRE);
+  if(cached) return cached;
+
+  // A derivative already built eagerly is as good as an expansion.
+  Expr* expr = lazy->source;
+  void* res = __atomic_load_n(&expr->derivative, __ATOMIC_ACQUIRE);
+  if(res) retain(res);
+  else res = applyRule(expr, lazyDerivative(expr->op1), lazyDerivative(expr->op2));
+
+  res = memoize(&lazy->expansion, res, lazy);
+  release(res);
+  return res;
+}
+
+static const char* operatorName(TokenType op) {
+  switch(op) {
+    case PLUS: return "+";
+    case MINUS: return "-";
+    case STAR: return "*";
+    case SLASH: return "/";
+    case POW: return "^";
+#define OPERATOR_NAME_CASE(token, name, ...) case token: return name;
+    UNARY_RULES(OPERATOR_NAME_CASE)
+    default: return "?";
+  }
+}
+
+// Writes as much of text as *left allows; false if it did not all fit.
+static bool streamText(const char* text, FILE* out, size_t* left) {
+  size_t len = strlen(text);
+  size_t n = len < *left ? len : *left;
+  fwrite(text, 1, n, out);
+  *left -= n;
+  return n == len;
+}
+
+static bool streamNode(void* node, FILE* out, size_t* left) {
+  if(node == NULL) return true;
+  if(*left == 0) return false;
+
+  node = forceLazy(node);
+  if(*((ValType*) node) == EXPR) {
+    Expr* expr = (Expr*) node;
+    if(!streamText("(", out, left) || !streamText(operatorName(expr->operator), out, left) ||
+       !streamText(" ", out, left) || !streamNode(expr->op1, out, left)) {
+      return false;
+    }
+    if(expr->op2 && (!streamText(" ", out, left) || !streamNode(expr->op2, out, left))) return false;
+    return streamText(")", out, left);
+  }
+
+  char* text = lisptify(node);
+  bool done = streamText(text, out, left);
+  free(text);
+  return done;
+}
+
+// Prints node in lisptify() form, stopping after limit bytes, and returns
+// the number of bytes written. Lazy subtrees past the cut are never built.
+size_t printLazy(void* node, FILE* out, size_t limit) {
+  size_t left = limit;
+  streamNode(node, out, &left);
+  return limit - left;
+}
+
+// Drops trailing zero coefficients in place.
+// What simplify() would return for node, except that where that is an
+// expression the result is some expression standing in for it: simplify()
+// only ever tells expressions apart from numbers, x and polynomials, so
+// the stand-in folds the same way. Operands are only read as far as that
+// needs, so a sum whose first operand stays an expression ends there.
+static void* foldNode(void* node) {
+  node = forceLazy(node);
+  if(node == NULL) return NULL;
+  if(*((ValType*) node) != EXPR) return retain(node);
+
+  Expr* expr = (Expr*) node;
+  void* cached = __atomic_load_n(&expr->simplified, __ATOMIC_ACQUIRE);
+  if(cached) return retain(cached);
+
+  void* op1 = foldNode(expr->op1);
+  if(op1 == NULL) return NULL;
+
+  // Only u * 0 and u^0 fold when u stays an expression, and simplify()
+  // leaves functions alone, even of constants: (sin 0) stays.
+  bool unary = !isArithmetic(expr->operator) && expr->operator != POW;
+  bool absorbs = expr->operator == STAR || expr->operator == POW;
+  if(unary || (*((ValType*) op1) == EXPR && !absorbs)) {
+    release(op1);
+    return retain(expr);
+  }
 
-        form->op1 = simplify(form->op1);
-        form->op2 = simplify(form->op2);
-
-        ValType o1t = *((ValType*) form->op1);
-        ValType o2t = form->op2 ? *((ValType*) form->op2) : -10000;
-
-        if (o1t == LITERAL && o2t == LITERAL) {
-            Literal* a = (Literal*)form->op1;
-            Literal* b = (Literal*)form->op2;
-            TokenType at = a->type;
-            TokenType bt = b->type;
-
-            // Handle addition
-            if (form->operator == PLUS) {
-                if (at == NUMBER && bt == NUMBER) {
-                    Literal* res = malloc(sizeof(Literal));
-                    res->valType = LITERAL;
-                    res->type = NUMBER;
-                    res->value.number = a->value.number + b->value.number;
-                    return res;
-                }
-                if (at == NUMBER && a->value.number == 0) return b; // 0 + b = b
-                if (bt == NUMBER && b->value.number == 0) return a; // a + 0 = a
-            }
+  void* op2 = foldNode(expr->op2);
+  void* res = simplifyForm(expr, op1, op2);
+  release(op1);
+  release(op2);
+  return res;
+}
 
+// True if simplify() would fold node to the number 0, answered without
+// building the simplified tree. Zeros simplify() cannot see, such as
+// (- (sin x) (sin x)), are reported as non-zero.
+bool isZero(void* node) {
+  void* folded = foldNode(node);
+  bool zero = folded != NULL && *((ValType*) folded) == LITERAL &&
+              ((Literal*) folded)->type == NUMBER && ((Literal*) folded)->value.number == 0;
+  release(folded);
+  return zero;
+}
 
-            // Handle subtraction
-            if (form->operator == MINUS) {
-                if (at == NUMBER && bt == NUMBER) {
-                    Literal* res = malloc(sizeof(Literal));
-                    res->valType = LITERAL;
-                    res->type = NUMBER;
-                    res->value.number = a->value.number - b->value.number;
-                    return res;
-                }
-                if (bt == NUMBER && b->value.number == 0) return a; // a - 0 = a
-                if (at == NUMBER && a->value.number == b->value.number) {
-                    Literal* res = malloc(sizeof(Literal));
-                    res->valType = LITERAL;
-                    res->type = NUMBER;
-                    res->value.number = 0; // a - a = 0
-                    return res;
-                }
 
-                // 0 - a = -a
-                 if (at == NUMBER && a->value.number == 0) {
-                   b->value.number *= -1;
-                   return b;
-                }
+// Work-stealing pool for fork-join over independent subtrees. Each thread
+// owns a deque: it pushes and pops forked tasks at the bottom while idle
+// threads steal the oldest (largest) task from the top. The calling thread
+// of parallelDispatch/parallelSimplify acts as worker 0.
+typedef struct {
+  TaskFn fn;
+  void* arg;
+  void* result;
+  int done;
+} Task;
 
-              //return exprOrLiteral;
-            }
+typedef struct {
+  pthread_mutex_t lock;
+  Task* tasks[DEQUE_SIZE];
+  int top;
+  int bottom;
+} Deque;
+
+static struct {
+  int threads;
+  int active;
+  int stop;
+  Deque deques[MAX_THREADS];
+  pthread_t workers[MAX_THREADS];
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+} pool = { .threads = 1, .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+
+static __thread int workerId = -1;
+
+static bool pushTask(Deque* deque, Task* task) {
+  pthread_mutex_lock(&deque->lock);
+  bool pushed = deque->bottom < DEQUE_SIZE;
+  if(pushed) deque->tasks[deque->bottom++] = task;
+  pthread_mutex_unlock(&deque->lock);
+  return pushed;
+}
 
-            // Handle multiplication
-            if (form->operator == STAR) {
-                if (at == NUMBER && bt == NUMBER) {
-                    Literal* res = malloc(sizeof(Literal));
-                    res->valType = LITERAL;
-                    res->type = NUMBER;
-                    res->value.number = a->value.number * b->value.number;
-                    return res;
-                }
-                if ((at == NUMBER && a->value.number == 0) || (bt == NUMBER && b->value.number == 0)) {
-                    Literal* res = malloc(sizeof(Literal));
-                    res->valType = LITERAL;
-                    res->type = NUMBER;
-                    res->value.number = 0; // 0 * anything = 0
-                    return res;
-                }
-                if (at == NUMBER && a->value.number == 1) return b; // 1 * b = b
-                if (bt == NUMBER && b->value.number == 1) return a; // a * 1 = a
+static Task* popTask(Deque* deque) {
+  Task* task = NULL;
+  pthread_mutex_lock(&deque->lock);
+  if(deque->bottom > deque->top) task = deque->tasks[--deque->bottom];
+  if(deque->bottom == deque->top) deque->bottom = deque->top = 0;
+  pthread_mutex_unlock(&deque->lock);
+  return task;
+}
 
-                //return exprOrLiteral;
-            }
+static Task* stealTask(Deque* deque) {
+  Task* task = NULL;
+  pthread_mutex_lock(&deque->lock);
+  if(deque->bottom > deque->top) task = deque->tasks[deque->top++];
+  if(deque->bottom == deque->top) deque->bottom = deque->top = 0;
+  pthread_mutex_unlock(&deque->lock);
+  return task;
+}
 
-            // Handle division
-            if (form->operator == SLASH) {
-                if (bt == NUMBER && b->value.number == 0) {
-                    // Division by zero handling
-                    return NULL; // or some error handling
-                }
-                if (at == NUMBER && bt == NUMBER) {
-                    Literal* res = malloc(sizeof(Literal));
-                    res->valType = LITERAL;
-                    res->type = NUMBER;
-                    res->value.number = a->value.number / b->value.number;
-                    return res;
-                }
-                if (bt == NUMBER && b->value.number == 1) return a; // a / 1 = a
-                if (at == NUMBER && a->value.number == 0) {
-                    Literal* res = malloc(sizeof(Literal));
-                    res->valType = LITERAL;
-                    res->type = NUMBER;
-                    res->value.number = 0; // 0 / anything = 0
-                    return res;
-                }
-              //return exprOrLiteral;
-            }
+static Task* stealAny() {
+  for(int i = 1; i < pool.threads; i++) {
+    Task* task = stealTask(&pool.deques[(workerId + i) % pool.threads]);
+    if(task) return task;
+  }
+  return NULL;
+}
 
-            // Handle exponentiation
-            if (form->operator == POW) {
-                if(bt == NUMBER && b->value.number == 1) {
-                  return a;
-                }
-                if (at == NUMBER && bt == NUMBER) {
-                    Literal* res = malloc(sizeof(Literal));
-                    res->valType = LITERAL;
-                    res->type = NUMBER;
-                    res->value.number = pow(a->value.number, b->value.number);
-                    return res;
-                }
-                if (bt == NUMBER && b->value.number == 0) {
-                    // Any number to the power of 0 is 1
-                    Literal* res = malloc(sizeof(Literal));
-                    res->valType = LITERAL;
-                    res->type = NUMBER;
-                    res->value.number = 1;
-                    return res;
-                }
-                if (at == NUMBER && a->value.number == 0 && b->value.number > 0) {
-                    // 0 to any positive power is 0
-                    Literal* res = malloc(sizeof(Literal));
-                    res->valType = LITERAL;
-                    res->type = NUMBER;
-                    res->value.number = 0;
-                    return res;
-                }
-                if (at == NUMBER && a->value.number == 1) {
-                    return a; // 1 to any power is 1
-                }
+static void runTask(Task* task) {
+  task->result = task->fn(task->arg);
+  __atomic_store_n(&task->done, 1, __ATOMIC_RELEASE);
+}
 
-                  //return exprOrLiteral;
+static void* workerMain(void* arg) {
+  workerId = (int) (intptr_t) arg;
 
-            }
-        }
+  for(;;) {
+    if(__atomic_load_n(&pool.active, __ATOMIC_ACQUIRE) == 0) {
+      pthread_mutex_lock(&pool.lock);
+      while(!__atomic_load_n(&pool.stop, __ATOMIC_ACQUIRE) && !__atomic_load_n(&pool.active, __ATOMIC_ACQUIRE)) {
+        pthread_cond_wait(&pool.wake, &pool.lock);
+      }
+      pthread_mutex_unlock(&pool.lock);
+    }
+    if(__atomic_load_n(&pool.stop, __ATOMIC_ACQUIRE)) {
+      returnFreeNodes();
+      return NULL;
+    }
 
+    Task* task = stealAny();
+    if(task) runTask(task);
+    else sched_yield();
+  }
+}
 
-        if(o1t == LITERAL && o2t != LITERAL) {
+// Computes *ra = fn(a) and *rb = fn(b), offering fn(b) to other threads
+// while this one works on fn(a). Runs both inline outside the pool.
+void forkJoin(TaskFn fn, void* a, void* b, void** ra, void** rb) {
+  Task task = { fn, b, NULL, 0 };
 
-            Literal* a = (Literal*)form->op1;
-            Expr* b = (Expr*)form->op2;
-          if(form->operator == PLUS) {
-            if(a->value.number == 0) {
-              return simplify(b);
-            }
-          }
-
-          if(form->operator == STAR) {
-            if(a->value.number == 0) {
-              Literal* res = malloc(sizeof(Literal));
-              res->valType = LITERAL;
-              res->type = NUMBER;
-              res->value.number = 0;
-              return res;
-            }
+  if(workerId < 0 || pool.threads <= 1 || !pushTask(&pool.deques[workerId], &task)) {
+    *ra = fn(a);
+    *rb = fn(b);
+    return;
+  }
 
-            if(a->value.number == 1) {
-              return simplify(b);
-            }
-          }
+  *ra = fn(a);
 
-        }
+  // Everything forked inside fn(a) has been joined, so our task is either
+  // still at the bottom of our deque or has been stolen.
+  if(popTask(&pool.deques[workerId]) == &task) {
+    *rb = fn(b);
+    return;
+  }
 
+  while(!__atomic_load_n(&task.done, __ATOMIC_ACQUIRE)) {
+    Task* other = stealAny();
+    if(other) runTask(other);
+    else sched_yield();
+  }
+  *rb = task.result;
+}
 
-        if(o2t == LITERAL && o1t != LITERAL) {
+void startParallel(int threads) {
+  if(threads < 1) threads = 1;
+  if(threads > MAX_THREADS) threads = MAX_THREADS;
+  if(threads == pool.threads) return;
 
-                      Expr* a = (Expr*)form->op1;
-            Literal* b = (Literal*)form->op2;
-          if(form->operator == PLUS) {
-            if(b->value.number == 0) {
-              return simplify(a);
-            }
-          }
-
-          if(form->operator == STAR) {
-            if(b->value.number == 0) {
-              Literal* res = malloc(sizeof(Literal));
-              res->valType = LITERAL;
-              res->type = NUMBER;
-              res->value.number = 0;
-              return res;
-            }
+  stopParallel();
 
-            if(b->value.number == 1) {
-              return simplify(a);
-            }
-          }
+  pool.stop = 0;
+  pool.threads = threads;
+  for(int i = 0; i < threads; i++) {
+    pthread_mutex_init(&pool.deques[i].lock, NULL);
+    pool.deques[i].top = pool.deques[i].bottom = 0;
+  }
+  for(int i = 1; i < threads; i++) {
+    pthread_create(&pool.workers[i], NULL, workerMain, (void*) (intptr_t) i);
+  }
+}
 
-        }
+void stopParallel() {
+  pthread_mutex_lock(&pool.lock);
+  __atomic_store_n(&pool.stop, 1, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&pool.wake);
+  pthread_mutex_unlock(&pool.lock);
 
+  for(int i = 1; i < pool.threads; i++) pthread_join(pool.workers[i], NULL);
+  for(int i = 0; i < pool.threads; i++) pthread_mutex_destroy(&pool.deques[i].lock);
+  pool.threads = 1;
+}
 
-      return form;
+// Frees every node chunk if no node is live any more; call it with no pool
+// running. Returns false, freeing nothing, while some node is still in use.
+bool releaseNodeMemory() {
+  if(pool.threads > 1) return false;
+
+  pthread_mutex_lock(&nodePool.lock);
+  bool idle = nodePool.liveNodes + liveNodes == 0;
+  if(idle) {
+    while(nodePool.chunks) {
+      NodeChunk* next = nodePool.chunks->next;
+      free(nodePool.chunks);
+      nodePool.chunks = next;
     }
+    nodePool.free = (FreeList) { NULL, NULL, 0 };
+    nodePool.liveNodes = 0;
+    freeNodes = (FreeList) { NULL, NULL, 0 };
+    liveNodes = 0;
+  }
+  pthread_mutex_unlock(&nodePool.lock);
+  return idle;
+}
 
-    if (type == LITERAL) {
-        return exprOrLiteral;
-    }
+// Only one thread at a time may drive the pool.
+static void* runParallel(TaskFn fn, void* arg) {
+  if(pool.threads <= 1) return fn(arg);
 
-    return exprOrLiteral;
+  workerId = 0;
+  pthread_mutex_lock(&pool.lock);
+  __atomic_store_n(&pool.active, 1, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&pool.wake);
+  pthread_mutex_unlock(&pool.lock);
+
+  void* res = fn(arg);
+
+  __atomic_store_n(&pool.active, 0, __ATOMIC_RELEASE);
+  workerId = -1;
+  return res;
 }
 
+// Same result as dispatch()/simplify(), with the two operands of large
+// arithmetic nodes handled as parallel tasks.
+void* parallelDispatch(void* exprOrLiteral) {
+  return runParallel(dispatch, exprOrLiteral);
+}
 
-void* dispatch(void* exprOrLiteral) {
-  if(exprOrLiteral == NULL) return NULL;
-  ValType type = *((ValType*) exprOrLiteral);
+void* parallelSimplify(void* exprOrLiteral) {
+  return runParallel(simplify, exprOrLiteral);
+}
 
-  if(type == EXPR) {
-    Expr* expr = (Expr*) exprOrLiteral;
-    return ((void* (*)(Expr*))expr->interpretThyself)((void*) expr);
+// True if path names a node of root: '1' or '2' at each level, never '2'
+// under a unary function and never past a leaf.
+static bool isValidPath(void* root, const char* path) {
+  for(; *path != '\0'; path++) {
+    root = forceLazy(root);
+    if(root == NULL || *((ValType*) root) != EXPR) return false;
+
+    Expr* expr = (Expr*) root;
+    if(*path == '1') root = expr->op1;
+    else if(*path == '2' && expr->op2 != NULL) root = expr->op2;
+    else return false;
   }
+  return true;
+}
 
-  if(type == LITERAL) {
-    Literal* literal = (Literal*) exprOrLiteral;
-    return ((void* (*)(void))literal->interpretThyself)();
+// Returns a copy of root with the node at path replaced, or NULL if path is
+// not valid for root. path picks op1 or op2 with '1' or '2' at each level
+// from the root. Only the nodes along the path are new; everything else,
+// memoized results included, is shared with root. Takes ownership of
+// replacement, releasing it on failure.
+void* replaceSubtree(void* root, const char* path, void* replacement) {
+  if(!isValidPath(root, path)) {
+    release(replacement);
+    return NULL;
+  }
+  if(*path == '\0') return replacement;
+
+  Expr* expr = (Expr*) forceLazy(root);
+  void* op1 = retain(expr->op1);
+  void* op2 = retain(expr->op2);
+
+  if(*path == '1') {
+    release(op1);
+    op1 = replaceSubtree(expr->op1, path + 1, replacement);
+  } else {
+    release(op2);
+    op2 = replaceSubtree(expr->op2, path + 1, replacement);
   }
 
-  return NULL;
+  return newExpr(expr->operator, op1, op2);
 }
 
-void* derivNum() {
-  Literal* literal = malloc(sizeof(literal));
-  literal->valType = LITERAL;
-  literal->type = NUMBER;
-  literal->value.number = 0;
+// Takes ownership of expr.
+DiffSession* newSession(void* expr) {
+  DiffSession* session = malloc(sizeof(DiffSession));
+  session->expr = expr;
+  session->derivative = dispatch(expr);
+  session->simplified = simplify(session->derivative);
+  return session;
+}
 
-  return (void*) literal;
+// Swaps the subtree at path (see replaceSubtree) for replacement and brings
+// the derivative and its simplification up to date. Only nodes on the path
+// from the edit to the root miss the memo, so the work is proportional to
+// the depth of the edit rather than the size of the expression. Returns
+// false, leaving the session as it was, if path is not valid.
+bool editSession(DiffSession* session, const char* path, void* replacement) {
+  void* expr = replaceSubtree(session->expr, path, replacement);
+  if(expr == NULL) return false;
+
+  void* derivative = dispatch(expr);
+  void* simplified = simplify(derivative);
+
+  release(session->simplified);
+  release(session->derivative);
+  release(session->expr);
+
+  session->expr = expr;
+  session->derivative = derivative;
+  session->simplified = simplified;
+  return true;
 }
 
-void* derivVar() {
-  Literal* literal = malloc(sizeof(literal));
-  literal->valType = LITERAL;
-  literal->type = NUMBER;
-  literal->value.number = 1;
+void freeSession(DiffSession* session) {
+  release(session->simplified);
+  release(session->derivative);
+  release(session->expr);
+  free(session);
+}
 
-  return (void*) literal;
+static size_t hashInstr(const Instr* instr) {
+  uint64_t bits;
+  memcpy(&bits, &instr->number, sizeof bits);
+  uint64_t h = (uint64_t) instr->kind * 0x9E3779B97F4A7C15ull;
+  h = (h ^ (uint64_t) instr->op) * 0xBF58476D1CE4E5B9ull;
+  h = (h ^ (uint64_t) (uint32_t) instr->a) * 0x94D049BB133111EBull;
+  h = (h ^ (uint64_t) (uint32_t) instr->b) * 0x9E3779B97F4A7C15ull;
+  h = (h ^ bits ^ (uint64_t) (uintptr_t) instr->poly) * 0xBF58476D1CE4E5B9ull;
+  return (size_t) (h ^ (h >> 31));
 }
 
+static size_t hashNode(const void* node) {
+  uint64_t h = (uint64_t) (uintptr_t) node * 0x9E3779B97F4A7C15ull;
+  return (size_t) (h ^ (h >> 29));
+}
 
-void* derivAdd(Expr* expr) {
-  Expr* newExpr = malloc(sizeof(Expr));
-  newExpr->valType = EXPR;
-  newExpr->operator = PLUS;
+static bool sameInstr(const Instr* a, const Instr* b) {
+  return a->kind == b->kind && a->op == b->op && a->a == b->a && a->b == b->b &&
+         memcmp(&a->number, &b->number, sizeof(double)) == 0 && a->poly == b->poly;
+}
 
-  newExpr->op1 = dispatch(expr->op1);//->interpretThyself();
-  newExpr->op2 = dispatch(expr->op2);//interpretThyself();
+// Both tables are open addressed and kept at most half full.
+static void growProgramTables(Program* program) {
+  int size = program->tableSize ? program->tableSize * 2 : 1024;
+  while(2 * program->size > size || 2 * program->nodeCount > size) size *= 2;
+  int* instrTable = malloc(size * sizeof(int));
+  void** nodeKeys = calloc(size, sizeof(void*));
+  int* nodeSlots = malloc(size * sizeof(int));
+  for(int i = 0; i < size; i++) instrTable[i] = -1;
+
+  for(int i = 0; i < program->size; i++) {
+    size_t h = hashInstr(&program->code[i]) & (size - 1);
+    while(instrTable[h] >= 0) h = (h + 1) & (size - 1);
+    instrTable[h] = i;
+  }
+  for(int i = 0; i < program->tableSize; i++) {
+    void* key = program->nodeKeys[i];
+    if(key == NULL) continue;
+    size_t h = hashNode(key) & (size - 1);
+    while(nodeKeys[h] != NULL) h = (h + 1) & (size - 1);
+    nodeKeys[h] = key;
+    nodeSlots[h] = program->nodeSlots[i];
+  }
 
-  return (void*) newExpr;
+  free(program->instrTable);
+  free(program->nodeKeys);
+  free(program->nodeSlots);
+  program->instrTable = instrTable;
+  program->nodeKeys = nodeKeys;
+  program->nodeSlots = nodeSlots;
+  program->tableSize = size;
 }
 
-void* derivSub(Expr* expr) {
-  Expr* newExpr = malloc(sizeof(Expr));
-  newExpr->valType = EXPR;
-  newExpr->operator = MINUS;
+// Register holding instr, appending it unless an identical one exists.
+static int emitInstr(Program* program, Instr instr) {
+  int mask = program->tableSize - 1;
+  size_t h = hashInstr(&instr) & mask;
+  for(; program->instrTable[h] >= 0; h = (h + 1) & mask) {
+    if(sameInstr(&program->code[program->instrTable[h]], &instr)) return program->instrTable[h];
+  }
 
-  newExpr->op1 = dispatch(expr->op1);//->interpretThyself();
-  newExpr->op2 = dispatch(expr->op2);//interpretThyself();
+  if(program->size == program->capacity) {
+    program->capacity = program->capacity ? program->capacity * 2 : 256;
+    program->code = realloc(program->code, program->capacity * sizeof(Instr));
+  }
+  if(instr.poly) retain(instr.poly);
 
-  return (void*) newExpr;
+  int slot = program->size++;
+  program->code[slot] = instr;
+  program->instrTable[h] = slot;
+  if(2 * program->size > program->tableSize) growProgramTables(program);
+  return slot;
 }
 
-void* derivMult(Expr* expr) {
-  // u'v
-  Expr* u = malloc(sizeof(Expr));
-  u->valType = EXPR;
-  u->operator = STAR;
-
-  u->op1 = dispatch(expr->op1);
-  u->op2 = expr->op2;
+static int compileNode(Program* program, void* node) {
+  Instr instr = { LITERAL, NUMBER, -1, -1, -1, NAN, NULL };
+  if(node == NULL) return emitInstr(program, instr);
+  if(*((ValType*) node) == LAZY) return compileNode(program, forceLazy(node));
 
-  // v'u
-  Expr* v = malloc(sizeof(Expr));
-  v->valType = EXPR;
-  v->operator = STAR;
+  int mask = program->tableSize - 1;
+  size_t h = hashNode(node) & mask;
+  for(; program->nodeKeys[h] != NULL; h = (h + 1) & mask) {
+    if(program->nodeKeys[h] == node) return program->nodeSlots[h];
+  }
 
-  v->op1 = expr->op1;
-  v->op2 = dispatch(expr->op2);
+  ValType type = *((ValType*) node);
+  if(type == LITERAL) {
+    Literal* literal = (Literal*) node;
+    instr.op = literal->type;
+    instr.number = literal->type == NUMBER ? literal->value.number : 0;
+  } else if(type == POLY) {
+    instr.kind = POLY;
+    instr.op = VAR;
+    instr.number = 0;
+    instr.poly = (Poly*) node;
+  } else {
+    Expr* expr = (Expr*) node;
+    instr.kind = EXPR;
+    instr.op = expr->operator;
+    instr.number = 0;
+    instr.a = compileNode(program, expr->op1);
+    // A missing operand, as simplify() leaves for division by zero, compiles
+    // to a NaN literal just as evaluate() reads it.
+    if(isArithmetic(expr->operator) || expr->operator == POW) instr.b = compileNode(program, expr->op2);
+  }
 
-  // u'v + v'u
-  Expr* uv = malloc(sizeof(Expr));
-  uv->valType = EXPR;
-  uv->operator = PLUS;
+  int slot = emitInstr(program, instr);
 
-  uv->op1 = u;
-  uv->op2 = v;
+  // Compiling operands or emitting may have grown the tables.
+  mask = program->tableSize - 1;
+  h = hashNode(node) & mask;
+  while(program->nodeKeys[h] != NULL) h = (h + 1) & mask;
+  program->nodeKeys[h] = node;
+  program->nodeSlots[h] = slot;
+  if(2 * ++program->nodeCount > program->tableSize) growProgramTables(program);
 
-  return (void*) uv;
+  return slot;
 }
 
-void* derivQuot(Expr* expr) {
-  // u'v
-  Expr* u = malloc(sizeof(Expr));
-  u->valType = EXPR;
-  u->operator = STAR;
+// Until now a, b and outputs name instructions. Assigns each instruction a
+// register, taking one freed by an operand whose last reader it is, and
+// rewrites them to name registers.
+static void allocateRegisters(Program* program) {
+  int size = program->size;
+  int* lastUse = malloc(size * sizeof(int));
+  int* registerOf = malloc(size * sizeof(int));
+  int* freeRegisters = malloc(size * sizeof(int));
+  int freeCount = 0;
+
+  for(int i = 0; i < size; i++) lastUse[i] = -1;
+  for(int i = 0; i < size; i++) {
+    if(program->code[i].a >= 0) lastUse[program->code[i].a] = i;
+    if(program->code[i].b >= 0) lastUse[program->code[i].b] = i;
+  }
+  for(int k = 0; k < program->outputCount; k++) lastUse[program->outputs[k]] = size;
+
+  program->registerCount = 0;
+  for(int i = 0; i < size; i++) {
+    Instr* instr = &program->code[i];
+
+    // Operands whose last reader this is are freed before the result is
+    // placed; instructions work lane by lane, so it may overwrite them.
+    int a = instr->a, b = instr->b;
+    if(a >= 0) instr->a = registerOf[a];
+    if(b >= 0) instr->b = registerOf[b];
+    if(a >= 0 && lastUse[a] == i) freeRegisters[freeCount++] = registerOf[a];
+    if(b >= 0 && b != a && lastUse[b] == i) freeRegisters[freeCount++] = registerOf[b];
+
+    instr->dst = freeCount > 0 ? freeRegisters[--freeCount] : program->registerCount++;
+    registerOf[i] = instr->dst;
+    if(lastUse[i] < 0) freeRegisters[freeCount++] = instr->dst;
+  }
 
-  u->op1 = dispatch(expr->op1);
-  u->op2 = expr->op2;
+  for(int k = 0; k < program->outputCount; k++) program->outputs[k] = registerOf[program->outputs[k]];
 
-  // v'u
-  Expr* v = malloc(sizeof(Expr));
-  v->valType = EXPR;
-  v->operator = STAR;
+  free(lastUse);
+  free(registerOf);
+  free(freeRegisters);
+}
 
-  v->op1 = expr->op1;
-  v->op2 = dispatch(expr->op2);
+// The expressions are only read; they may be freed once this returns.
+Program* compileProgram(void** exprs, int count) {
+  Program* program = calloc(1, sizeof(Program));
+  growProgramTables(program);
+
+  program->outputCount = count;
+  program->outputs = malloc(count * sizeof(int));
+  for(int i = 0; i < count; i++) program->outputs[i] = compileNode(program, exprs[i]);
+  allocateRegisters(program);
+
+  // Node pointers are only meaningful while compiling.
+  free(program->nodeKeys);
+  free(program->nodeSlots);
+  free(program->instrTable);
+  program->nodeKeys = NULL;
+  program->nodeSlots = NULL;
+  program->instrTable = NULL;
+  return program;
+}
 
-  // u'v - v'u
-  Expr* uv = malloc(sizeof(Expr));
-  uv->valType = EXPR;
-  uv->operator = MINUS;
+// Evaluates every output at each of the n values in xs, in one pass over
+// the instructions per batch of lanes; out[k * n + j] is output k at xs[j].
+// Gives the same values as evaluate() on each expression.
+void runProgram(const Program* program, const double* xs, size_t n, double* out) {
+  size_t lanes = FUSED_LANES;
+  double* regs = malloc(program->registerCount * lanes * sizeof(double));
+
+  for(size_t base = 0; base < n; base += lanes) {
+    size_t m = n - base < lanes ? n - base : lanes;
+    const double* x = xs + base;
+
+    for(int i = 0; i < program->size; i++) {
+      const Instr* instr = &program->code[i];
+      double* r = regs + instr->dst * lanes;
+      const double* ra = regs + (instr->a >= 0 ? instr->a : 0) * lanes;
+      const double* rb = regs + (instr->b >= 0 ? instr->b : 0) * lanes;
+
+      if(instr->kind == LITERAL) {
+        if(instr->op == VAR) memcpy(r, x, m * sizeof(double));
+        else for(size_t j = 0; j < m; j++) r[j] = instr->number;
+        continue;
+      }
 
-  uv->op1 = u;
-  uv->op2 = v;
+      if(instr->kind == POLY) {
+        evalPolyBatch(instr->poly, x, r, m);
+        continue;
+      }
 
-  // v^2
-  Expr* vv = malloc(sizeof(Expr));
-  vv->valType = EXPR;
-  vv->operator = POW;
+      switch(instr->op) {
+        case PLUS: for(size_t j = 0; j < m; j++) r[j] = ra[j] + rb[j]; break;
+        case MINUS: for(size_t j = 0; j < m; j++) r[j] = ra[j] - rb[j]; break;
+        case STAR: for(size_t j = 0; j < m; j++) r[j] = ra[j] * rb[j]; break;
+        case SLASH: for(size_t j = 0; j < m; j++) r[j] = ra[j] / rb[j]; break;
+        case POW: for(size_t j = 0; j < m; j++) r[j] = pow(ra[j], rb[j]); break;
+#define RUN_PROGRAM_CASE(token, name, fn, ...) \
+        case token: for(size_t j = 0; j < m; j++) r[j] = fn(ra[j]); break;
+        UNARY_RULES(RUN_PROGRAM_CASE)
+        default: for(size_t j = 0; j < m; j++) r[j] = NAN; break;
+      }
+    }
 
-  vv->op1 = expr->op2;
+    for(int k = 0; k < program->outputCount; k++) {
+      memcpy(out + k * n + base, regs + program->outputs[k] * lanes, m * sizeof(double));
+    }
+  }
 
-  Literal* pow2 = malloc(sizeof(Literal));
-  pow2->valType = LITERAL;
-  pow2->type = NUMBER;
-  pow2->value.number = 2;
+  free(regs);
+}
 
-  vv->op2 = pow2;
+void freeProgram(Program* program) {
+  for(int i = 0; i < program->size; i++) release(program->code[i].poly);
+  free(program->code);
+  free(program->outputs);
+  free(program);
+}
 
 
+// Interval evaluation: every bound is computed in round-to-nearest and then
+// moved outward by ARITH_ULPS/LIBM_ULPS, so the true range of the expression
+// over x is always contained in the result.
+static const Interval EMPTY_INTERVAL = {NAN, NAN};
+static const Interval WHOLE_LINE = {-INFINITY, INFINITY};
 
-  // Combine ( u'v - v'u ) / v^2
+static bool isEmptyInterval(Interval a) {
+  return isnan(a.lo) || isnan(a.hi);
+}
 
-  Expr* quot = malloc(sizeof(Expr));
-  quot->valType = EXPR;
-  quot->operator = SLASH;
+static Interval outward(double lo, double hi, int ulps) {
+  // inf - inf and 0 * inf come out as NaN; anything is possible there.
+  if(isnan(lo) || isnan(hi)) return WHOLE_LINE;
 
-  quot->op1 = uv;
-  quot->op2 = vv;
+  for(int i = 0; i < ulps; i++) {
+    lo = nextafter(lo, -INFINITY);
+    hi = nextafter(hi, INFINITY);
+  }
+  return (Interval) {lo, hi};
+}
 
-  return (void*) quot;
+// 0 * inf is 0 here: an infinite bound only stands for "arbitrarily large".
+static double boundProduct(double a, double b) {
+  return a == 0 || b == 0 ? 0 : a * b;
 }
 
-void* derivPow(Expr* expr) {
-  // u'v
-  Expr* u = malloc(sizeof(Expr));
-  u->valType = EXPR;
-  u->operator = STAR;
+static Interval intervalOperate(Interval a, Interval b, TokenType op) {
+  if(isEmptyInterval(a) || isEmptyInterval(b)) return EMPTY_INTERVAL;
+
+  switch(op) {
+    case PLUS:
+      return outward(a.lo + b.lo, a.hi + b.hi, ARITH_ULPS);
+    case MINUS:
+      return outward(a.lo - b.hi, a.hi - b.lo, ARITH_ULPS);
+    case STAR:
+    case SLASH: {
+      if(op == SLASH && b.lo <= 0 && b.hi >= 0) return WHOLE_LINE;
+
+      double p[4];
+      if(op == STAR) {
+        p[0] = boundProduct(a.lo, b.lo);
+        p[1] = boundProduct(a.lo, b.hi);
+        p[2] = boundProduct(a.hi, b.lo);
+        p[3] = boundProduct(a.hi, b.hi);
+      } else {
+        p[0] = a.lo / b.lo;
+        p[1] = a.lo / b.hi;
+        p[2] = a.hi / b.lo;
+        p[3] = a.hi / b.hi;
+      }
+
+      double lo = p[0], hi = p[0];
+      for(int i = 1; i < 4; i++) {
+        lo = fmin(lo, p[i]);
+        hi = fmax(hi, p[i]);
+      }
+      return outward(lo, hi, ARITH_ULPS);
+    }
+    default:
+      return WHOLE_LINE;
+  }
+}
+
+// f monotone on [domainLo, domainHi]; u is clipped to that domain first.
+static Interval intervalMonotone(double (*fn)(double), Interval u, double domainLo,
+                                 double domainHi, bool increasing) {
+  double lo = fmax(u.lo, domainLo), hi = fmin(u.hi, domainHi);
+  if(isEmptyInterval(u) || lo > hi) return EMPTY_INTERVAL;
 
-  // coefficient
-  Literal* unary = malloc(sizeof(Literal));
-  unary->valType = LITERAL;
-  unary->type = NUMBER;
-  unary->value.number = ((Literal*) expr->op2)->value.number;
-  u->op1 = unary;
+  return increasing ? outward(fn(lo), fn(hi), LIBM_ULPS) : outward(fn(hi), fn(lo), LIBM_ULPS);
+}
 
-  // subtract 1 from the original expression power
-  ((Literal*)expr->op2)->value.number -= 1;
-  u->op2 = expr;
-  //memcpy(u->op2, expr, sizeof(expr));
+static Interval intervalIncreasing(double (*fn)(double), Interval u, double domainLo, double domainHi) {
+  return intervalMonotone(fn, u, domainLo, domainHi, true);
+}
 
-  return (void*) u;
+static Interval intervalDecreasing(double (*fn)(double), Interval u, double domainLo, double domainHi) {
+  return intervalMonotone(fn, u, domainLo, domainHi, false);
 }
 
-void* derivSin(Expr* expr) {
-  Expr* cos = malloc(sizeof(Expr));
+// Beyond this the reduction x / period is too coarse to place extrema.
+#define PERIODIC_LIMIT 1e6
 
-  cos->valType = EXPR;
-  cos->operator = COS;
+// True if some peak + k * period may lie in u; errs towards true.
+static bool containsPoint(Interval u, double peak, double period) {
+  double slack = 1e-9;
+  return ceil((u.lo - peak) / period - slack) <= floor((u.hi - peak) / period + slack);
+}
 
-  cos->op1 = expr->op1;
+// sin and cos: maximum 1 at peak + 2k pi, minimum -1 half a period later.
+static Interval intervalPeriodic(double (*fn)(double), Interval u, double peak) {
+  if(isEmptyInterval(u)) return EMPTY_INTERVAL;
+  if(u.hi - u.lo >= 2 * M_PI || fabs(u.lo) > PERIODIC_LIMIT || fabs(u.hi) > PERIODIC_LIMIT) {
+    return (Interval) {-1, 1};
+  }
 
-  Expr* final = malloc(sizeof(Expr));
-  final->valType = EXPR;
-  final->operator = STAR;
+  Interval res = outward(fmin(fn(u.lo), fn(u.hi)), fmax(fn(u.lo), fn(u.hi)), LIBM_ULPS);
+  if(containsPoint(u, peak, 2 * M_PI)) res.hi = 1;
+  if(containsPoint(u, peak + M_PI, 2 * M_PI)) res.lo = -1;
 
-  final->op2 = cos;
-  final->op1 = dispatch(expr->op1);
+  res.lo = fmax(res.lo, -1);
+  res.hi = fmin(res.hi, 1);
+  return res;
+}
 
-  return (void*) final;
+static Interval intervalSin(Interval u) {
+  return intervalPeriodic(sin, u, M_PI / 2);
 }
 
-void* derivCos(Expr* expr) {
-  Expr* sin = malloc(sizeof(Expr));
+static Interval intervalCos(Interval u) {
+  return intervalPeriodic(cos, u, 0);
+}
 
-  sin->valType = EXPR;
-  sin->operator = SIN;
+// tan is increasing between its poles at pi/2 + k pi.
+static Interval intervalTan(Interval u) {
+  if(isEmptyInterval(u)) return EMPTY_INTERVAL;
+  if(u.hi - u.lo >= M_PI || fabs(u.lo) > PERIODIC_LIMIT || fabs(u.hi) > PERIODIC_LIMIT ||
+     containsPoint(u, M_PI / 2, M_PI)) {
+    return WHOLE_LINE;
+  }
 
-  sin->op1 = expr->op1;
+  return outward(tan(u.lo), tan(u.hi), LIBM_ULPS);
+}
 
-  Expr* neg1 = malloc(sizeof(Expr));
-  neg1->valType = EXPR;
-  neg1->operator = STAR;
+static Interval intervalCosh(Interval u) {
+  if(isEmptyInterval(u)) return EMPTY_INTERVAL;
+  if(u.lo >= 0) return intervalIncreasing(cosh, u, 0, INFINITY);
+  if(u.hi <= 0) return intervalDecreasing(cosh, u, -INFINITY, 0);
 
-  neg1->op1 = sin;
-  Literal* n1 = malloc(sizeof(Literal));
-  n1->valType = LITERAL;
-  n1->type = NUMBER;
-  n1->value.number = -1;
+  return outward(1, cosh(fmax(-u.lo, u.hi)), LIBM_ULPS);
+}
 
-  neg1->op1 = n1;
-  neg1->op2 = sin;
+static Interval intervalPow(Interval u, Interval v) {
+  if(isEmptyInterval(u) || isEmptyInterval(v)) return EMPTY_INTERVAL;
 
-  Expr* final = malloc(sizeof(Expr));
-  final->valType = EXPR;
-  final->operator = STAR;
+  // Integer exponent: defined for negative bases too, even powers fold at 0.
+  if(v.lo == v.hi && v.lo == floor(v.lo) && fabs(v.lo) <= MAX_POLY_DEGREE) {
+    int n = (int) v.lo;
+    if(n == 0) return (Interval) {1, 1};
+    if(n < 0) return intervalOperate((Interval) {1, 1}, intervalPow(u, (Interval) {-n, -n}), SLASH);
 
-  final->op2 = neg1;
-  final->op1 = dispatch(expr->op1);
+    double lo = pow(u.lo, n), hi = pow(u.hi, n);
+    if(n % 2) return outward(lo, hi, LIBM_ULPS);
+    if(u.lo >= 0) return outward(lo, hi, LIBM_ULPS);
+    if(u.hi <= 0) return outward(hi, lo, LIBM_ULPS);
+    return outward(0, fmax(lo, hi), LIBM_ULPS);
+  }
 
+  // u^v = exp(v ln u) for u >= 0.
+  Interval logU = intervalIncreasing(log, u, 0, INFINITY);
+  Interval res = intervalIncreasing(exp, intervalOperate(v, logU, STAR), -INFINITY, INFINITY);
+
+  // Negative bases are defined at integer exponents only, giving |u|^v with
+  // either sign.
+  if(u.lo < 0 && ceil(v.lo) <= floor(v.hi)) {
+    Interval absU = {u.hi < 0 ? -u.hi : 0, fmax(-u.lo, u.hi)};
+    Interval logAbsU = intervalIncreasing(log, absU, 0, INFINITY);
+    Interval magnitude = intervalIncreasing(exp, intervalOperate(v, logAbsU, STAR), -INFINITY, INFINITY);
+    if(isEmptyInterval(res)) res = (Interval) {-magnitude.hi, magnitude.hi};
+    else res = (Interval) {fmin(res.lo, -magnitude.hi), fmax(res.hi, magnitude.hi)};
+  }
+  return res;
+}
 
-  return (void*) final;
+// Horner's scheme over intervals.
+static Interval intervalPoly(const Poly* poly, Interval x) {
+  Interval res = {poly->coeffs[poly->degree], poly->coeffs[poly->degree]};
+  for(int i = poly->degree - 1; i >= 0; i--) {
+    Interval c = {poly->coeffs[i], poly->coeffs[i]};
+    res = intervalOperate(intervalOperate(res, x, STAR), c, PLUS);
+  }
+  return res;
 }
 
-void* derivTan(Expr* expr) {
-  Expr* cos = malloc(sizeof(Expr));
-  cos->valType = EXPR;
-  cos->operator = COS;
-  cos->op1 = expr->op1;
+Interval evaluateInterval(void* exprOrLiteral, Interval x) {
+  if(exprOrLiteral == NULL || isEmptyInterval(x)) return EMPTY_INTERVAL;
 
+  ValType type = *((ValType*) exprOrLiteral);
 
+  if(type == LITERAL) {
+    Literal* literal = (Literal*) exprOrLiteral;
+    if(literal->type == VAR) return x;
+    return (Interval) {literal->value.number, literal->value.number};
+  }
 
-  Expr* pow2 = malloc(sizeof(Expr));
-  pow2->valType = EXPR;
-  pow2->operator = POW;
-  Literal* uu = malloc(sizeof(Literal));
-  uu->valType = LITERAL;
-  uu->type = NUMBER;
-  uu->value.number = 2;
-  pow2->op1 = cos;
-  pow2->op2 = uu;
+  if(type == POLY) {
+    return intervalPoly((Poly*) exprOrLiteral, x);
+  }
 
+  if(type == LAZY) {
+    return evaluateInterval(forceLazy(exprOrLiteral), x);
+  }
 
-  Expr* final = malloc(sizeof(Expr));
-  final->valType = EXPR;
-  final->operator = SLASH;
+  Expr* expr = (Expr*) exprOrLiteral;
+  Interval u = evaluateInterval(expr->op1, x);
 
-  final->op1 = dispatch(expr->op1);
-  final->op2 = pow2;
+  switch(expr->operator) {
+#define INTERVAL_CASE(token, name, fn, op, outer, range) case token: return range;
+    UNARY_RULES(INTERVAL_CASE)
+    case POW:
+      return intervalPow(u, evaluateInterval(expr->op2, x));
+    default:
+      return intervalOperate(u, evaluateInterval(expr->op2, x), expr->operator);
+  }
+}
 
+// Evaluates every output over each of the n intervals in xs, FUSED_LANES at
+// a time; out[k * n + j] is output k over xs[j]. Gives the same bounds as
+// evaluateInterval() on each expression.
+void runIntervalProgram(const Program* program, const Interval* xs, size_t n, Interval* out) {
+  size_t lanes = FUSED_LANES;
+  Interval* regs = malloc(program->registerCount * lanes * sizeof(Interval));
+
+  for(size_t base = 0; base < n; base += lanes) {
+    size_t m = n - base < lanes ? n - base : lanes;
+    const Interval* x = xs + base;
+
+    for(int i = 0; i < program->size; i++) {
+      const Instr* instr = &program->code[i];
+      Interval* r = regs + instr->dst * lanes;
+      const Interval* ra = regs + (instr->a >= 0 ? instr->a : 0) * lanes;
+      const Interval* rb = regs + (instr->b >= 0 ? instr->b : 0) * lanes;
+
+      if(instr->kind == LITERAL) {
+        if(instr->op == VAR) memcpy(r, x, m * sizeof(Interval));
+        else for(size_t j = 0; j < m; j++) r[j] = (Interval) {instr->number, instr->number};
+        continue;
+      }
 
-  return (void*) final;
-}
+      if(instr->kind == POLY) {
+        for(size_t j = 0; j < m; j++) r[j] = intervalPoly(instr->poly, x[j]);
+        continue;
+      }
 
-void* derivLn(Expr* expr) {
-  Expr* denominator = expr->op1;
-  Expr* numerator = dispatch(expr->op1);
+      switch(instr->op) {
+        case POW: for(size_t j = 0; j < m; j++) r[j] = intervalPow(ra[j], rb[j]); break;
+#define RUN_INTERVAL_CASE(token, name, fn, op, outer, range) \
+        case token: \
+          for(size_t j = 0; j < m; j++) { \
+            Interval u = ra[j]; \
+            r[j] = range; \
+          } \
+          break;
+        UNARY_RULES(RUN_INTERVAL_CASE)
+        default: for(size_t j = 0; j < m; j++) r[j] = intervalOperate(ra[j], rb[j], instr->op); break;
+      }
+    }
 
-  Expr* final = malloc(sizeof(Expr));
-  final->valType = EXPR;
-  final->operator = SLASH;
+    for(int k = 0; k < program->outputCount; k++) {
+      memcpy(out + k * n + base, regs + program->outputs[k] * lanes, m * sizeof(Interval));
+    }
+  }
 
-  final->op1 = numerator;
-  final->op2 = denominator;
+  free(regs);
+}
 
-  return (void*) final;
+static bool excludesZero(Interval a) {
+  return !isEmptyInterval(a) && (a.lo > 0 || a.hi < 0);
 }
 
-void* derivExp(Expr* expr) {
-  Expr* final = malloc(sizeof(Expr));
-  final->valType = EXPR;
-  final->operator = STAR;
+// Bisects domain down to pieces narrower than tolerance and writes the
+// pieces that may contain a zero of expr to out (adjacent pieces merged, in
+// increasing order). Each level of the subdivision is bounded in one batch
+// through a fused interval program. A piece is dropped when the bound on
+// expr excludes 0, or is empty because expr is undefined throughout it. If
+// derivative is given and its bound excludes 0, expr is monotone there and
+// the signs at the two ends, again evaluated as one batch, settle the piece
+// without splitting it further.
+// Returns the number of regions found, which may exceed capacity.
+size_t findRootRegions(void* expr, void* derivative, Interval domain, double tolerance,
+                       Interval* out, size_t capacity) {
+  typedef enum { OPEN, SETTLED, DROPPED, MONOTONE } PieceState;
+  typedef struct {
+    Interval x;
+    PieceState state;
+  } Piece;
+
+  void* exprs[2] = { expr, derivative };
+  Program* values = compileProgram(exprs, 1);
+  Program* bounds = derivative ? compileProgram(exprs, 2) : values;
+
+  size_t size = 1, capacityPieces = 64;
+  Piece* pieces = malloc(capacityPieces * sizeof(Piece));
+  Piece* next = malloc(capacityPieces * sizeof(Piece));
+  Interval* xs = malloc(2 * capacityPieces * sizeof(Interval));
+  Interval* res = malloc(2 * capacityPieces * sizeof(Interval));
+  pieces[0] = (Piece) {domain, OPEN};
+  bool pending = true;
+
+  while(pending) {
+    pending = false;
+    if(2 * size > capacityPieces) {
+      capacityPieces = 2 * size;
+      next = realloc(next, capacityPieces * sizeof(Piece));
+      pieces = realloc(pieces, capacityPieces * sizeof(Piece));
+      xs = realloc(xs, 2 * capacityPieces * sizeof(Interval));
+      res = realloc(res, 2 * capacityPieces * sizeof(Interval));
+    }
+
+    // Bound expr, and derivative, over every open piece at once.
+    size_t n = 0;
+    for(size_t i = 0; i < size; i++) {
+      if(pieces[i].state == OPEN) xs[n++] = pieces[i].x;
+    }
+    runIntervalProgram(bounds, xs, n, res);
+
+    size_t j = 0, ends = 0;
+    for(size_t i = 0; i < size; i++) {
+      if(pieces[i].state != OPEN) continue;
+      if(isEmptyInterval(res[j]) || excludesZero(res[j])) pieces[i].state = DROPPED;
+      else if(derivative && excludesZero(res[n + j])) pieces[i].state = MONOTONE;
+      j++;
+    }
 
-  final->op2 = expr;
-  final->op1 = dispatch(expr->op1);
+    // Then expr at both ends of every monotone piece.
+    for(size_t i = 0; i < size; i++) {
+      if(pieces[i].state != MONOTONE) continue;
+      xs[ends++] = (Interval) {pieces[i].x.lo, pieces[i].x.lo};
+      xs[ends++] = (Interval) {pieces[i].x.hi, pieces[i].x.hi};
+    }
+    runIntervalProgram(values, xs, ends, res);
+
+    size_t nextSize = 0, end = 0;
+    for(size_t i = 0; i < size; i++) {
+      Piece piece = pieces[i];
+      if(piece.state == DROPPED) continue;
+      if(piece.state == SETTLED) {
+        next[nextSize++] = piece;
+        continue;
+      }
 
-  return (void*) final;
-}
+      Interval x = piece.x;
+      if(piece.state == MONOTONE) {
+        Interval lo = res[end++];
+        Interval hi = res[end++];
+        bool samePositive = lo.lo > 0 && hi.lo > 0;
+        bool sameNegative = lo.hi < 0 && hi.hi < 0;
+        if(!samePositive && !sameNegative) next[nextSize++] = (Piece) {x, SETTLED};
+        continue;
+      }
+
+      double mid = x.lo + (x.hi - x.lo) / 2;
+      if(x.hi - x.lo < tolerance || mid <= x.lo || mid >= x.hi) {
+        next[nextSize++] = (Piece) {x, SETTLED};
+        continue;
+      }
+
+      next[nextSize++] = (Piece) {{x.lo, mid}, OPEN};
+      next[nextSize++] = (Piece) {{mid, x.hi}, OPEN};
+      pending = true;
+    }
+
+    Piece* swap = pieces;
+    pieces = next;
+    next = swap;
+    size = nextSize;
+  }
 
+  size_t count = 0;
+  for(size_t i = 0; i < size; i++) {
+    if(i > 0 && pieces[i - 1].x.hi == pieces[i].x.lo) {
+      if(count <= capacity) out[count - 1].hi = pieces[i].x.hi;
+      continue;
+    }
+    if(count < capacity) out[count] = pieces[i].x;
+    count++;
+  }
 
+  if(bounds != values) freeProgram(bounds);
+  freeProgram(values);
+  free(pieces);
+  free(next);
+  free(xs);
+  free(res);
+  return count;
+}
 
 
 void printAST(void* exprOrLiteral) {
   if(exprOrLiteral == NULL) return;
   ValType type = *((ValType*) exprOrLiteral);
 
+  if(type == LAZY) {
+    printAST(forceLazy(exprOrLiteral));
+    return;
+  }
+
 
   if(type == EXPR) {
     Expr* expr = (Expr*) exprOrLiteral;
@@ -671,10 +2295,29 @@ void printAST(void* exprOrLiteral) {
 
     return;
   }
+
+  if(type == POLY) {
+    char* expanded = lisptify(exprOrLiteral);
+    printf("%s", expanded);
+    free(expanded);
+  }
 }
 
 bool isDigit(char c) {return c >= '0' && c <= '9';}
 
+// Length of the longest function name from UNARY_RULES at the start of
+// source, so that "sinh" is not read as "sin"; 0 if there is none.
+int matchFunction(const char* source, TokenType* type) {
+  int best = 0;
+#define MATCH_FUNCTION(token, name, ...) \
+  if(strncmp(source, name, strlen(name)) == 0 && (int) strlen(name) > best) { \
+    best = strlen(name); \
+    *type = token; \
+  }
+  UNARY_RULES(MATCH_FUNCTION)
+  return best;
+}
+
 TokensList tokenize(const char* expr) {
   static int sz = 8;
   static float scaleFactor = 1.5f;
@@ -697,11 +2340,13 @@ TokensList tokenize(const char* expr) {
         case '/': tokens[idx].type = SLASH; break;
         case '^': tokens[idx].type = POW; break;
         case 'x': tokens[idx].type = VAR; break;
-        case 's': tokens[idx].type = SIN; i++; i++; break;
-        case 'c': tokens[idx].type = COS; i++; i++; break;
-        case 't': tokens[idx].type = TAN; i++; i++; break;
-        case 'l': tokens[idx].type = LN;  i++;    ; break;
-        case 'e': tokens[idx].type = EXP; i++; i++; break;
+    }
+
+    TokenType function;
+    int nameLength = matchFunction(expr + i, &function);
+    if(nameLength > 0) {
+      tokens[idx].type = function;
+      i += nameLength - 1;
     }
 
     if(isDigit(ch)) {
@@ -748,11 +2393,8 @@ void printTokens(TokensList tokens) {
         case RIGHT_PAREN: printf(")"); break;
         case NUMBER: printf("%f", token.value.number); break;
         case VAR: printf("x"); break;
-        case SIN: printf("sin "); break;
-        case COS: printf("cos "); break;
-        case TAN: printf("tan "); break;
-        case EXP: printf("exp "); break;
-        case LN: printf("ln "); break;
+#define PRINT_TOKEN_CASE(token, name, ...) case token: printf(name " "); break;
+        UNARY_RULES(PRINT_TOKEN_CASE)
     }
 
   }
@@ -771,39 +2413,18 @@ void* expr(TokensList t, int* idx, int sz) {
     TokenType operator = t.tokens[*idx].type;
     *idx = *idx + 1; // advance
 
-    Expr* newExpr = malloc(sizeof(Expr));
-    newExpr->valType = EXPR;
-    newExpr->operator = operator;
-
-    newExpr->op1 = newExpr->op2 = NULL;
-
-    switch(operator) {
-        case PLUS: newExpr->interpretThyself = derivAdd; break;
-        case MINUS: newExpr->interpretThyself = derivSub; break;
-        case STAR: newExpr->interpretThyself = derivMult; break;
-        case SLASH: newExpr->interpretThyself = derivQuot; break;
-        //case POW: newExpr->interpretThyself = derivPow; break;
-        case SIN: newExpr->interpretThyself = derivSin; break;
-        case COS: newExpr->interpretThyself = derivCos; break;
-        case TAN: newExpr->interpretThyself = derivTan; break;
-        case LN: newExpr->interpretThyself = derivLn; break;
-        case EXP: newExpr->interpretThyself = derivExp; break;
-    }
+    void* op1 = NULL;
+    void* op2 = NULL;
 
     if(*idx < sz && t.tokens[*idx].type != RIGHT_PAREN) {
-      newExpr->op1 = operand(t, idx, sz);
-      ValType type = *((ValType*) newExpr->op1); // Type of value we are dealing with i.e. an expr or a literal.
-      //newExpr->op1Type = type;
+      op1 = operand(t, idx, sz);
     }
 
     if(*idx < sz && t.tokens[*idx].type != RIGHT_PAREN) {
-      newExpr->op2 = operand(t, idx, sz);
-      ValType type = *((ValType*) newExpr->op2); // Type of value we are dealing with i.e. an expr or a literal.
-      //newExpr->op2Type = type;
+      op2 = operand(t, idx, sz);
     }
 
-
-    return (void*) newExpr;
+    return (void*) newExpr(operator, op1, op2);
   }
 
   return operand(t, idx, sz);
@@ -811,20 +2432,13 @@ void* expr(TokensList t, int* idx, int sz) {
 
 void* operand(TokensList t, int* idx, int sz) {
   if(*idx < sz && t.tokens[*idx].type == NUMBER) {
-    Literal* literal = malloc(sizeof(Literal));
-    literal->valType = LITERAL;
-    literal->type = NUMBER;
-    literal->value.number = t.tokens[*idx].value.number;
-    literal->interpretThyself = (void*)derivNum;
+    Literal* literal = newNumber(t.tokens[*idx].value.number);
     *idx = *idx + 1;
     return (void*) literal;
   }
 
   if(*idx < sz && t.tokens[*idx].type == VAR) {
-    Literal* literal = malloc(sizeof(Literal));
-    literal->valType = LITERAL;
-    literal->type = VAR;
-    literal->interpretThyself =(void*) derivVar;
+    Literal* literal = newVar();
     *idx = *idx + 1;
     return (void*) literal;
   }
@@ -839,7 +2453,371 @@ void* operand(TokensList t, int* idx, int sz) {
 }
 
 
-int main() {
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Writes a random balanced prefix expression of the given depth to *cur,
+// with operators drawn from ops.
+static void generateExpr(char** cur, int depth, const char* ops, unsigned* seed) {
+    int r = rand_r(seed) % 4;
+
+    if(depth == 0) {
+        if(r < 2) *cur += sprintf(*cur, "(sin x)");
+        else if(r == 2) *cur += sprintf(*cur, "x");
+        else *cur += sprintf(*cur, "%d", 1 + rand_r(seed) % 9);
+        return;
+    }
+
+    *cur += sprintf(*cur, "(%c ", ops[r % strlen(ops)]);
+    generateExpr(cur, depth - 1, ops, seed);
+    *cur += sprintf(*cur, " ");
+    generateExpr(cur, depth - 1, ops, seed);
+    *cur += sprintf(*cur, ")");
+}
+
+void* parseString(const char* source) {
+    TokensList tokens = tokenize(source);
+    int idx = 0;
+    void* res = parse(tokens, &idx, tokens.size);
+    free(tokens.tokens);
+    return res;
+}
+
+static void* randomExpr(int depth, const char* ops, unsigned* seed) {
+    char* source = malloc(((size_t) 16 << depth) + 16);
+    char* cur = source;
+    generateExpr(&cur, depth, ops, seed);
+    void* res = parseString(source);
+    free(source);
+    return res;
+}
+
+// Writes the replaceSubtree() path of a random leaf of root to path.
+static void randomLeafPath(void* root, char* path, unsigned* seed) {
+    int len = 0;
+    for(void* node = root; *((ValType*) node) == EXPR; len++) {
+        Expr* expr = (Expr*) node;
+        bool left = expr->op2 == NULL || rand_r(seed) % 2;
+        path[len] = left ? '1' : '2';
+        node = left ? expr->op1 : expr->op2;
+    }
+    path[len] = '\0';
+}
+
+// Times dispatch() + simplify() on one large expression for 1..64 threads
+// and checks every result against the serial one.
+int benchParallel(int depth) {
+    unsigned seed = 42;
+    void* expr = randomExpr(depth, "+-*/", &seed);
+    printf("expression: %zu nodes\n", nodeSize(expr));
+
+    void* reference = NULL;
+    double serial = 0;
+
+    printf("%8s %10s %8s %s\n", "threads", "seconds", "speedup", "identical");
+    for(int threads = 1; threads <= MAX_THREADS; threads *= 2) {
+        startParallel(threads);
+
+        // Start each round from an unmemoized tree.
+        forgetMemos(expr);
+        double start = now();
+        void* derived = parallelDispatch(expr);
+        void* simplified = parallelSimplify(derived);
+        double elapsed = now() - start;
+
+        if(threads == 1) {
+            serial = elapsed;
+            reference = retain(simplified);
+        }
+
+        printf("%8d %10.3f %8.2f %s\n", threads, elapsed, serial / elapsed,
+               equalTrees(reference, simplified) ? "yes" : "NO");
+
+        release(simplified);
+        release(derived);
+    }
+
+    stopParallel();
+    release(reference);
+    release(expr);
+    releaseNodeMemory();
+    return 0;
+}
+
+// Times random constant edits followed by re-differentiation through a
+// DiffSession against differentiating and simplifying from scratch.
+int benchIncremental(int depth, int edits) {
+    unsigned seed = 42;
+    DiffSession* session = newSession(randomExpr(depth, "+-*/", &seed));
+    printf("expression: %zu nodes, %d edits\n", nodeSize(session->expr), edits);
+
+    double incremental = 0, full = 0;
+    bool identical = true;
+    char path[64];
+
+    for(int i = 0; i < edits; i++) {
+        randomLeafPath(session->expr, path, &seed);
+        double start = now();
+        editSession(session, path, newNumber(1 + rand_r(&seed) % 9));
+        incremental += now() - start;
+
+        void* fresh = copyTree(session->expr);
+        start = now();
+        void* derivative = dispatch(fresh);
+        void* simplified = simplify(derivative);
+        full += now() - start;
+
+        identical = identical && equalTrees(simplified, session->simplified);
+        release(simplified);
+        release(derivative);
+        release(fresh);
+    }
+
+    printf("full recompute: %10.6f s/edit\n", full / edits);
+    printf("incremental:    %10.6f s/edit\n", incremental / edits);
+    printf("speedup: %.1fx, identical: %s\n", full / incremental, identical ? "yes" : "NO");
+
+    freeSession(session);
+    return 0;
+}
+
+// Evaluates variants of one expression plus their simplified derivatives
+// at the same points, tree by tree and as one fused program.
+int benchFused(int count, int points) {
+    // Shallow enough, and without division, to stay finite at every point.
+    unsigned seed = 42;
+    void* base = randomExpr(8, "+-*", &seed);
+
+    // Each variant replaces one leaf of the base expression with a constant.
+    void** exprs = malloc(2 * count * sizeof(void*));
+    size_t nodes = 0;
+    for(int i = 0; i < count; i++) {
+        char path[64];
+        randomLeafPath(base, path, &seed);
+        exprs[2 * i] = replaceSubtree(base, path, newNumber(1 + rand_r(&seed) % 9));
+        void* derivative = dispatch(exprs[2 * i]);
+        exprs[2 * i + 1] = simplify(derivative);
+        release(derivative);
+        nodes += nodeSize(exprs[2 * i]) + nodeSize(exprs[2 * i + 1]);
+    }
+
+    double* xs = malloc(points * sizeof(double));
+    for(int j = 0; j < points; j++) xs[j] = 0.1 + 2.0 * j / points;
+    double* separate = malloc((size_t) 2 * count * points * sizeof(double));
+    double* fused = malloc((size_t) 2 * count * points * sizeof(double));
+
+    double start = now();
+    for(int k = 0; k < 2 * count; k++) {
+        for(int j = 0; j < points; j++) separate[(size_t) k * points + j] = evaluate(exprs[k], xs[j]);
+    }
+    double separateTime = now() - start;
+
+    start = now();
+    Program* program = compileProgram(exprs, 2 * count);
+    double compileTime = now() - start;
+
+    start = now();
+    runProgram(program, xs, points, fused);
+    double fusedTime = now() - start;
+
+    bool identical = true;
+    for(size_t i = 0; i < (size_t) 2 * count * points; i++) {
+        identical = identical && (separate[i] == fused[i] || (isnan(separate[i]) && isnan(fused[i])));
+    }
+
+    printf("%d expressions, %zu tree nodes, %d fused instructions in %d registers, %d points\n",
+           2 * count, nodes, program->size, program->registerCount, points);
+    printf("separate trees: %8.4f s\n", separateTime);
+    printf("fused program:  %8.4f s (+ %.4f s to compile)\n", fusedTime, compileTime);
+    printf("speedup: %.1fx, identical: %s\n", separateTime / fusedTime, identical ? "yes" : "NO");
+
+    freeProgram(program);
+    for(int k = 0; k < 2 * count; k++) release(exprs[k]);
+    release(base);
+    free(exprs);
+    free(xs);
+    free(separate);
+    free(fused);
+    return 0;
+}
+
+// Locates the zeros of a fixed expression on [-100, 100] by scanning for sign
+// changes between sample points and with interval bisection, and checks that
+// every sign change found by the scan lies in one of the interval regions.
+// Bounds each of count expressions over pieces of domain with the fused
+// interval program. Sets *sound if every bound contains evaluate() at the
+// ends and midpoint of its piece, *agrees if it equals evaluateInterval().
+static void checkIntervals(void** exprs, int count, Interval domain, int pieces, bool* sound, bool* agrees) {
+    Interval* xs = malloc(pieces * sizeof(Interval));
+    Interval* bounds = malloc((size_t) count * pieces * sizeof(Interval));
+    double width = (domain.hi - domain.lo) / pieces;
+    for(int i = 0; i < pieces; i++) xs[i] = (Interval) {domain.lo + i * width, domain.lo + (i + 1) * width};
+
+    Program* program = compileProgram(exprs, count);
+    runIntervalProgram(program, xs, pieces, bounds);
+
+    *sound = *agrees = true;
+    for(int k = 0; k < count; k++) {
+        for(int i = 0; i < pieces; i++) {
+            Interval bound = bounds[(size_t) k * pieces + i];
+            Interval tree = evaluateInterval(exprs[k], xs[i]);
+            bool bothEmpty = isEmptyInterval(bound) && isEmptyInterval(tree);
+            *agrees = *agrees && (bothEmpty || (bound.lo == tree.lo && bound.hi == tree.hi));
+
+            double samples[3] = { xs[i].lo, xs[i].lo + width / 2, xs[i].hi };
+            for(int j = 0; j < 3; j++) {
+                double value = evaluate(exprs[k], samples[j]);
+                *sound = *sound && (isnan(value) || (bound.lo <= value && value <= bound.hi));
+            }
+        }
+    }
+
+    freeProgram(program);
+    free(xs);
+    free(bounds);
+}
+
+int benchRoots(int points) {
+    void* expr = parseString("(- (* (sin (* 3 x)) (+ 2 (cos x))) (/ x 4))");
+    void* derivative = dispatch(expr);
+    void* simplified = simplify(derivative);
+    Interval domain = {-100, 100};
+    double step = (domain.hi - domain.lo) / points;
+
+    double start = now();
+    size_t changes = 0;
+    double* brackets = malloc(points * sizeof(double));
+    double previous = evaluate(expr, domain.lo);
+    for(int i = 1; i <= points; i++) {
+        double value = evaluate(expr, domain.lo + i * step);
+        if((previous < 0) != (value < 0)) brackets[changes++] = domain.lo + (i - 1) * step;
+        previous = value;
+    }
+    double scanTime = now() - start;
+
+    Interval regions[256];
+    start = now();
+    size_t count = findRootRegions(expr, simplified, domain, step, regions, 256);
+    double intervalTime = now() - start;
+
+    bool covered = count <= 256;
+    for(size_t i = 0; covered && i < changes; i++) {
+        bool inside = false;
+        double lo = brackets[i], hi = brackets[i] + step;
+        for(size_t j = 0; j < count && !inside; j++) inside = regions[j].lo <= hi && lo <= regions[j].hi;
+        covered = inside;
+    }
+
+    printf("%d points, %zu sign changes, %zu regions\n", points, changes, count);
+    printf("pointwise scan:     %8.4f s\n", scanTime);
+    printf("interval bisection: %8.4f s\n", intervalTime);
+    printf("speedup: %.1fx, all sign changes covered: %s\n", scanTime / intervalTime, covered ? "yes" : "NO");
+
+    // The bounds behind the bisection, checked for this expression and for
+    // random ones with division and powers, each with its simplified
+    // derivative. That of (+ x (/ x 0)) keeps a NULL operand, (+ 1).
+    unsigned seed = 42;
+    void* checked[16] = { retain(expr), retain(simplified), parseString("(+ x (/ x 0))") };
+    for(int k = 2; k < 16; k += 2) {
+        if(k > 2) checked[k] = randomExpr(6, "+-*/^", &seed);
+        void* d = dispatch(checked[k]);
+        checked[k + 1] = simplify(d);
+        release(d);
+    }
+    bool sound, agrees;
+    checkIntervals(checked, 16, domain, 4096, &sound, &agrees);
+    printf("interval bounds contain every sample: %s, fused matches evaluateInterval(): %s\n",
+           sound ? "yes" : "NO", agrees ? "yes" : "NO");
+    for(int k = 0; k < 16; k++) release(checked[k]);
+
+    free(brackets);
+    release(simplified);
+    release(derivative);
+    release(expr);
+    return 0;
+}
+
+// Reads the first bytes of a large derivative, tests it for zero and
+// evaluates it, each through a lazy view and from the eagerly built tree.
+int benchLazy(int depth, int bytes) {
+    unsigned seed = 42;
+    void* expr = randomExpr(depth, "+-*/", &seed);
+    printf("expression: %zu nodes, printing %d bytes\n", nodeSize(expr), bytes);
+
+    char* eagerText = calloc(bytes + 1, 1);
+    char* lazyText = calloc(bytes + 1, 1);
+
+    double start = now();
+    void* derivative = dispatch(expr);
+    FILE* out = fmemopen(eagerText, bytes + 1, "w");
+    printLazy(derivative, out, bytes);
+    fclose(out);
+    bool eagerZero = isZero(derivative);
+    double eagerPrefix = now() - start;
+    double eagerValue = evaluate(derivative, 0.5);
+    double eagerTime = now() - start;
+
+    // So the lazy view does not find the eager derivative memoized.
+    forgetMemos(expr);
+    start = now();
+    void* view = lazyDerivative(expr);
+    out = fmemopen(lazyText, bytes + 1, "w");
+    printLazy(view, out, bytes);
+    fclose(out);
+    bool lazyZero = isZero(view);
+    double lazyPrefix = now() - start;
+    double lazyValue = evaluate(view, 0.5);
+    double lazyTime = now() - start;
+
+    // A view differentiates like the tree it stands for.
+    void* eagerSecond = dispatch(derivative);
+    void* lazySecond = lazyDerivative(view);
+    void* dispatchedSecond = dispatch(view);
+    bool identical = strcmp(eagerText, lazyText) == 0 && eagerZero == lazyZero &&
+                     (eagerValue == lazyValue || (isnan(eagerValue) && isnan(lazyValue))) &&
+                     equalTrees(eagerSecond, lazySecond) && equalTrees(eagerSecond, dispatchedSecond);
+    release(dispatchedSecond);
+    release(lazySecond);
+    release(eagerSecond);
+    release(view);
+    release(derivative);
+
+    printf("%-28s %10s %10s\n", "", "eager", "lazy");
+    printf("%-28s %10.6f %10.6f s\n", "print prefix + zero test", eagerPrefix, lazyPrefix);
+    printf("%-28s %10.6f %10.6f s\n", "... + evaluate at 0.5", eagerTime, lazyTime);
+    printf("prefix speedup: %.1fx, identical (second derivatives included): %s\n",
+           eagerPrefix / lazyPrefix, identical ? "yes" : "NO");
+
+    free(eagerText);
+    free(lazyText);
+    release(expr);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if(argc > 1 && strcmp(argv[1], "bench-parallel") == 0) {
+        return benchParallel(argc > 2 ? atoi(argv[2]) : 20);
+    }
+
+    if(argc > 1 && strcmp(argv[1], "bench-fused") == 0) {
+        return benchFused(argc > 2 ? atoi(argv[2]) : 100, argc > 3 ? atoi(argv[3]) : 1024);
+    }
+
+    if(argc > 1 && strcmp(argv[1], "bench-incremental") == 0) {
+        return benchIncremental(argc > 2 ? atoi(argv[2]) : 18, argc > 3 ? atoi(argv[3]) : 20);
+    }
+
+    if(argc > 1 && strcmp(argv[1], "bench-roots") == 0) {
+        return benchRoots(argc > 2 ? atoi(argv[2]) : 10000000);
+    }
+
+    if(argc > 1 && strcmp(argv[1], "bench-lazy") == 0) {
+        return benchLazy(argc > 2 ? atoi(argv[2]) : 20, argc > 3 ? atoi(argv[3]) : 200);
+    }
+
     printf("Hello world!\n");
     return 0;
 }